@@ -10,15 +10,41 @@
  *
  ********************************************************************/
 
+/* REG_RIP and REG_R8 from ucontext.h, for --guard fault reports */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <assert.h>
 #include <inttypes.h>
 #include <sys/stat.h>
-#include <except.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <tmmintrin.h>
+#endif
+
+#include "um.h"
+#include "um_jit.h"
+#include "um_perf.h"
+#include "um_sample.h"
+#include "um_cache.h"
+#include "um_aot.h"
 
 
 #define op_width 4
@@ -31,58 +57,284 @@
 #define reg_b_lsb 3
 #define reg_c_lsb 0 
 
-Except_T Bitpack_Overflow = { "Overflow packing bits" };
-
+#define min_size_class 1  /* 2 words, room for a free list link */
+#define num_size_classes 32
+
+#define no_segment UINT32_MAX  /* end of the unmapped slot list */
+#define read_chunk (1 << 20)   /* bytes per read() of a piped image */
+#define mapped_class -1        /* size_class of storage in a snapshot */
+#define mmap_class -2          /* size_class of storage mmap'd on its own */
+#define mmap_threshold (1 << 18) /* words (1 MB) from which storage is
+                                    fresh zero pages instead of pooled */
+#define guarded_class -3       /* size_class of storage with a guard after */
+#define guard_bytes ((size_t) 1 << 26) /* PROT_NONE after guarded storage */
+#define table_reserve_bytes (((size_t) UINT32_MAX + 1) * sizeof(Segment))
+                               /* --guard: a table slot for every id */
+#ifdef UM_ARENA
+#define region_bytes ((size_t) 1 << 34) /* the arena: segment ids are word
+                                           offsets into it, 32 bits */
+#define arena_segment_0 ((1u << 28) - 4) /* words segment 0 can grow to, 
+                                            at the start of the arena */
+#else
+#define region_bytes ((size_t) 1 << 36) /* --guard, --huge-pages address 
+                                           space for pooled storage */
+#endif
+#define region_commit ((size_t) 1 << 21) /* bytes made usable at a time, 
+                                            one huge page */
+#define snapshot_magic "UMSNAP1"
+#define snapshot_align 16
+#define cache_line 64
+#define console_buffer (1 << 16) /* bytes of OUTPUT, and per INPUT read */
+#define trace_depth 64         /* calls --sample keeps track of */
+#define sample_hz 1000         /* --sample ticks per second of CPU time */
+#define compile_threshold (1 << 16) /* words from which --compile-thread
+                                       predecodes a loaded segment */
+#define cache_threshold (1 << 16)   /* words from which --code-cache keeps
+                                       the predecoded segment 0 */
 
 typedef struct Array 
 {
-    int length;
+    uint32_t length;
+    int refs;              /* segment slots sharing this storage */
+    int size_class;        /* storage holds 1 << size_class words */
     uint32_t elems[];
 } *Array;
 
-
-typedef struct Stack  
+/* segment storage recycled by power-of-two size class, a free block keeps
+   the link to the next one in its first words */
+typedef struct Pool 
 {
-    int Length, capacity;
-    uint64_t *elems;
-} *Stack;
-
-typedef struct Sequence  
+    Array free_lists[num_size_classes];
+    char *region;          /* where new blocks come from, or NULL */
+    size_t region_used;
+    size_t region_usable;  /* the rest of the region is PROT_NONE */
+    bool huge_pages;       /* storage is madvise()d for huge pages */
+} *Pool;
+
+/* one slot of the segment table: the words and their count side by side, 
+   or while the slot is unmapped the id of the next unmapped slot. Four 
+   slots share a cache line */
+typedef struct Segment
 {
-    int Length, capacity;
-    Array *elems;
-} *Sequence;
-
-
-typedef struct UM_Mem {
-    Sequence memory;       /* A sequence of pointers to UArray_T segments */
-    Stack mem_tracker;/* A stack of integer seg_id’s */
-} *UM_Mem;
+    uint32_t *words;       /* elems of the Array, NULL while unmapped */
+    uint32_t length;
+    uint32_t next_free;
+} Segment;
+
+/* translated code reads the table as Aot_segment */
+typedef char aot_segment_layout[sizeof(Aot_segment) == sizeof(Segment)
+                                && offsetof(Aot_segment, words) 
+                                   == offsetof(Segment, words) ? 1 : -1];
+
+
+/* one predecoded instruction word: fields are extracted once when segment 0
+   is loaded so the hot loop never calls Bitpack_getu() twice on a word */
+typedef struct Decoded {
+    uint8_t opcode;
+    uint8_t reg_a;
+    uint8_t reg_b;
+    uint8_t reg_c;
+    uint32_t value;        /* 25-bit LOADV value, 0 for other opcodes */
+} Decoded;
+
+/* bytes waiting for INPUT or for the host to take from OUTPUT */
+typedef struct Byte_queue {
+    unsigned char *bytes;
+    size_t start;          /* first byte not yet taken */
+    size_t length;         /* bytes in use, taken ones included */
+    size_t capacity;
+} Byte_queue;
+
+/* when console output is written, besides a full buffer, an INPUT that 
+   has to wait for bytes and the end of the run (--flush) */
+typedef enum Um_flush {
+        FLUSH_INPUT = 0,       /* nowhere else */
+        FLUSH_LINE,            /* at every newline */
+        FLUSH_TIMED            /* at the first OUTPUT after an interval */
+} Um_flush;
+
+/* console I/O of a machine run from the command line, instead of stdio: 
+   OUTPUT collects in out and is written to out_fd with writev(), INPUT 
+   reads standard input ahead a buffer at a time */
+typedef struct Console {
+    unsigned char *out;
+    size_t out_length;
+    int out_fd;
+    Um_flush flush;
+    uint64_t interval;     /* FLUSH_TIMED, in ns */
+    uint64_t last_flush;   /* FLUSH_TIMED, monotonic ns */
+    bool holding;          /* --serve --warm, before the fork */
+    Byte_queue held;       /* output kept for every child to write first */
+    unsigned char *in;
+    size_t in_start;       /* first byte not yet read by INPUT */
+    size_t in_length;
+    bool end_of_input;
+    volatile sig_atomic_t writing; /* OUTPUT or a flush is changing the 
+                              buffers, --guard must not flush them */
+} Console;
+
+/* the call stack --sample reports, as near as LOADPs tell it: one whose 
+   return address (its own pc + 1) is in a register is a call, one to the
+   return address of a call on the stack returns from it */
+typedef struct Trace {
+    uint32_t calls[trace_depth];   /* pcs jumped to, outermost first */
+    uint32_t returns[trace_depth]; /* where each call goes back to */
+    int depth;             /* calls past trace_depth are not kept */
+    uint32_t loads;        /* LOADPs of another segment so far */
+    Samples samples;
+} Trace;
+
+/* a program um_aot translated, as Aot_main() runs it. Blocks are dropped
+   from the table one by one as their words are stored to */
+typedef struct Aot {
+    const Aot_program *program;
+    Aot_block **blocks;    /* by pc, NULL where none starts (any more) */
+    uint32_t running;      /* pc of the block running, if one is */
+} Aot;
+
+/* a segment 0 being predecoded by the --compile-thread helper. The 
+   storage is held by a ref, so a store into segment 0 copies it first and
+   the helper reads words nobody writes; the offsets stored to are noted 
+   and predecoded again when the helper's copy goes in */
+typedef struct Compile {
+    pthread_t thread;
+    Array code;
+    Decoded *decoded;      /* length + 1 records, written by the helper */
+    int done;              /* set by the helper when it is, __atomic */
+    uint32_t *stores;      /* offsets of segment 0 written since */
+    uint32_t num_stores;
+    uint32_t stores_capacity;
+    const char *cache_dir; /* where the helper saves it, or NULL */
+    Cache_key key;
+} Compile;
+
+struct UM_Mem {
+    Segment *segments;     /* segment table, cache line aligned */
+    uint32_t num_segments; /* slots handed out, mapped or not */
+    uint32_t capacity;
+    bool table_reserved;   /* --guard: segments starts a PROT_NONE mapping
+                              of table_reserve_bytes, usable to capacity */
+    uint32_t free_head;    /* first unmapped slot, or no_segment */
+    Pool pool;             /* storage of unmapped segments */
+#ifdef UM_ARENA
+    uint32_t *arena;       /* word 0 of segment 0, and segment id n's words
+                              are n words on */
+#endif
+    Decoded *decoded;      /* predecoded copy of segment 0, same length */
+    size_t decoded_mapped; /* bytes of it mapped from --code-cache, or 0 */
+    const char *cache_dir; /* --code-cache, or NULL */
+    Jit jit;               /* translated segment 0, NULL unless --engine jit */
+    Aot *aot;              /* segment 0 as um_aot translated it, NULL if 
+                              not run by Aot_main() or no longer that */
+    uint32_t registers[8]; /* where execution starts, zero unless restored */
+    uint32_t pc;
+    const char *checkpoint_file; /* written at the first INPUT, or NULL */
+    bool checkpoint_at_load; /* at the first LOADP of another segment 
+                                instead (--checkpoint-at load) */
+    int listen_fd;         /* --serve --warm forks from the first INPUT */
+    void *snapshot;        /* --restore mapping the segments live in */
+    size_t snapshot_size;
+#ifdef UM_PROFILE
+    bool profile;          /* --profile: execute() counts and reports */
+#endif
+    bool embedded;         /* made by Um_new(): I/O goes through the queues */
+    Byte_queue input;
+    Byte_queue output;
+    bool end_of_input;
+    bool halted;
+    uint64_t instructions; /* retired by Um_run(), and in a -DUM_PROFILE 
+                              build by execute() and execute_threaded() */
+    Console console;       /* unused while embedded */
+    uint32_t *running_registers; /* the engine's, for --guard reports */
+    Trace *trace;          /* --sample, NULL otherwise */
+    bool compile_thread;   /* --compile-thread */
+    Compile *compiling;    /* the helper's segment, NULL if none */
+};
+
+/* a --checkpoint file: this header, a Snapshot_slot per slot of the 
+   segment table, then the storage of every mapped segment laid out as an 
+   Array. It is native endian so --restore can point the segment table 
+   straight into a private mapping of the file */
+typedef struct Snapshot_header {
+    char magic[8];
+    uint32_t registers[8];
+    uint32_t pc;           /* of the INPUT or LOADP, run again on restore */
+    uint32_t num_segments;
+    uint32_t free_head;
+    uint32_t unused;
+} Snapshot_header;
+
+typedef struct Snapshot_slot {
+    uint64_t offset;       /* of the segment's Array, 0 while unmapped */
+    uint32_t next_free;
+    uint32_t unused;
+} Snapshot_slot;
 
 typedef enum Um_opcode {
         CMOV = 0, SLOAD, SSTORE, ADD, MUL, DIV,
         NAND, HALT, MAP, UNMAP, OUTPUT, INPUT, LOADP, LOADV
 } Um_opcode;
 
-
-static inline Sequence Seq_new (int hint);
-static inline void Seq_addhi (Sequence s, Array a);
-static inline void Seq_expand (Sequence s);
-static inline Array Seq_get (Sequence s, int index);
-static inline int Seq_length (Sequence s);
-static inline void Seq_put (Sequence s, int index, Array a);
-static inline void Seq_free(Sequence *s);
-static inline Stack Stack_new ();
-static inline void Stack_expand (Stack s);
-static inline void Stack_push (Stack s, uint64_t a);
-static inline uint64_t Stack_pop (Stack s);
-static inline bool Stack_empty(Stack s);
-static inline void Stack_free(Stack *s);
-static inline void Array_free (Array *a);
-static inline Array Array_copy (Array a, int length);
-static inline uint32_t* Array_at (Array a, int i);
-static inline Array Array_new (int length);
-static inline int Array_length (Array a);
+/* superinstructions: the predecoder writes one over the opcode of the first
+   word of a hot pair (counted with -DUM_FUSION_PROFILE), and its handler in
+   execute_threaded() runs both. The second word keeps its own record, so a
+   jump straight to it still works. No pair starts with an instruction the 
+   JIT leaves to interpret_exit() */
+typedef enum Um_fused {
+        LOADV_SLOAD = 16, LOADV_SSTORE, LOADV_ADD, LOADV_LOADV, 
+        LOADV_LOADP, NAND_NAND, NUM_HANDLERS
+} Um_fused;
+
+/* what a --code-cache artifact of segment 0 holds: Decoded records, 
+   fused unless built with -DUM_FUSION_PROFILE */
+#ifdef UM_FUSION_PROFILE
+#define decoded_format ((sizeof(Decoded) << 16) | 0)
+#else
+#define decoded_format ((sizeof(Decoded) << 16) | NUM_HANDLERS)
+#endif
+
+#ifdef UM_PROFILE
+/* what execute() counts under --profile. PCs are offsets in whatever 
+   segment 0 was at the time, so programs that LOADP other segments see 
+   their counts folded together */
+typedef struct Profile {
+    uint64_t opcodes[16];
+    uint64_t *pcs;             /* retired instructions by pc */
+    uint64_t *loadp_targets;   /* LOADPs by the pc they jumped to */
+    uint32_t length;           /* entries in pcs and loadp_targets */
+    uint64_t segment_loads;    /* LOADPs of a nonzero segment */
+    struct timespec start;
+} Profile;
+#endif
+
+/* execution engines selectable with --engine on the command line */
+typedef enum Um_engine {
+        ENGINE_SWITCH = 0, ENGINE_THREADED, ENGINE_JIT
+} Um_engine;
+
+
+
+static inline void Array_free (Pool pool, Array *a);
+static inline void Array_release (Pool pool, Array *a);
+static inline Array Array_copy (Pool pool, Array a, uint32_t length);
+static inline uint32_t* Array_at (Array a, uint32_t i);
+static inline Array Array_new (Pool pool, uint32_t length);
+static inline Pool Pool_new ();
+static inline Array Pool_take (Pool pool, uint32_t length);
+static inline Array Array_map (uint32_t length);
+static inline Array Array_guarded (uint32_t length);
+static inline void Pool_reserve (Pool pool);
+static inline void advise_huge_pages (void *address, size_t bytes);
+static inline Array Pool_carve (Pool pool, size_t bytes);
+static inline size_t Array_bytes (uint32_t length);
+static inline size_t guarded_bytes (uint32_t length);
+static inline void Pool_free (Pool *pool);
+static inline uint32_t Array_length (Array a);
+static inline Array Array_of (uint32_t *words);
+static void queue_put (Byte_queue *queue, const unsigned char *bytes, 
+                       size_t size);
+static size_t queue_take (Byte_queue *queue, unsigned char *bytes, 
+                          size_t size);
 static inline uint64_t Bitpack_getu(uint64_t word, unsigned width, 
                                     unsigned lsb);
 static inline uint64_t Bitpack_newu(uint64_t word, unsigned width, 
@@ -93,8 +345,7 @@ static inline bool Bitpack_fitsu(uint64_t n, unsigned width);
 /* function checks if the program counter is at last instruction */
 static bool last_instruction (int *pc, UM_Mem m);
 
-/* returns a new UM_Mem with an empty memory sequence capable of holding 
-   UArray segments, and an empty mem_tracker stack */
+/* returns a new UM_Mem with an empty segment table */
 static inline UM_Mem new_memory();
 
 /* frees all associated memory in the UM_mem */
@@ -102,22 +353,200 @@ static inline void free_memory(UM_Mem memory);
 
 /* creates a segment in UM_mem capable of holding num_words, 32-bit words and 
    returns seg_id */
-static inline int map_seg(UM_Mem memory, int num_words);  
+static inline uint32_t map_seg(UM_Mem memory, uint32_t num_words);  
 
-/* pushes segment id onto mem_tracker and frees segment memory */
+/* puts the segment's slot on the unmapped list and frees its storage */
 static inline void unmap_seg(UM_Mem memory, int seg_id); 
 
 /* returns address of a particular offset in a particular segment in memory */
-static inline uint32_t* mem_address(UM_Mem memory, int seg_id, int offset); 
+static inline uint32_t* mem_address(UM_Mem memory, int seg_id, 
+                                    uint32_t offset); 
 
-/* loads 32-bit word into segment 0 */
+/* loads the big-endian .um image into segment 0, "-" is standard input */
 static inline void load_instruction(UM_Mem memory, const char* filename); 
 
-/* mem segment at the seg_id is duplicated, and duplicate replaces segment 0*/
+/* reads fd to its end, returns the bytes and sets *size */
+static unsigned char *read_image(int fd, size_t *size);
+
+/* copies num_words big-endian words from image into words in host order */
+static void swap_words(uint32_t *words, const unsigned char *image, 
+                       size_t num_words);
+
+/* writes the machine, stopped at the INPUT or LOADP at pc, to 
+   m->checkpoint_file */
+static void write_checkpoint(UM_Mem memory, const uint32_t *registers, 
+                             uint32_t pc);
+
+/* called before every INPUT, checkpoints the first one if asked to */
+static inline void before_input(UM_Mem memory, const uint32_t *registers, 
+                                uint32_t pc);
+
+/* called before a LOADP of another segment while a checkpoint is still to
+   be written, writes it if that is where it was asked for */
+static inline void before_load(UM_Mem memory, const uint32_t *registers, 
+                               uint32_t pc);
+
+/* replaces the loaded program with the machine saved in filename */
+static void restore_snapshot(UM_Mem memory, const char *filename);
+
+/* returns true if the unmapped list from head runs through unmapped slots
+   of the num_slots only, once each, to its end */
+static bool free_list_valid(const Snapshot_slot *slots, uint32_t num_slots,
+                            uint32_t head);
+
+/* returns a Unix socket listening at path, replacing any file there */
+static int open_server_socket(const char *path);
+
+/* accepts connections on listen_fd forever, forking for each; returns only
+   in a child, with the connection as its stdin and stdout */
+static void serve(int listen_fd);
+
+/* starts console I/O, output going to out_fd */
+static void console_open(UM_Mem memory, int out_fd, Um_flush flush, 
+                         uint64_t interval);
+
+/* writes the held and buffered output */
+static void console_flush(UM_Mem memory);
+
+/* writes the remaining output and frees the console buffers */
+static void console_close(UM_Mem memory);
+
+/* refills the input buffer with one read(), writing output first, and 
+   returns false at the end of input */
+static bool console_fill(UM_Mem memory);
+
+/* writes count buffers to fd, whatever it takes */
+static void write_all(int fd, struct iovec *buffers, int count);
+
+/* returns monotonic time in ns, as cheap as the kernel can make it */
+static uint64_t now_ns(void);
+
+/* writes what output there is and exits, on an invalid instruction */
+static void fail(UM_Mem memory) __attribute__((noreturn));
+
+/* returns false, saying why on stderr, if the kernel will not back 
+   madvise()d memory with transparent huge pages */
+static bool huge_pages_available(void);
+
+/* makes a fault on a guard page or an unmapped segment of memory a UM 
+   failure with a report, for --guard */
+static void install_guard(UM_Mem memory);
+
+/* the SIGSEGV handler of --guard */
+static void guard_fault(int signal_number, siginfo_t *info, void *context);
+
+/* appends to report the pc of each segment 0 instruction that accesses 
+   segment seg_id at offset given registers, returns the new length */
+static int append_fault_pcs(UM_Mem memory, const uint32_t *registers, 
+                            uint32_t seg_id, uint64_t offset, char *report,
+                            int length, size_t size);
+
+/* moves the segment table to the start of a PROT_NONE reservation with a
+   slot for every 32-bit id, for --guard */
+static void reserve_table(UM_Mem memory);
+
+/* append text, or n in decimal, to report and return the new length; 
+   snprintf() is not async-signal-safe */
+static int append_text(char *report, int length, size_t size, 
+                       const char *text);
+static int append_number(char *report, int length, size_t size, 
+                         uint64_t n);
+
+/* writes size bytes to fd with write() alone, from a signal handler */
+static void write_raw(int fd, const void *bytes, size_t size);
+
+/* starts --sample taking samples, or again in a child of --serve --warm, 
+   which does not inherit the timer */
+static void start_sampling(UM_Mem memory);
+
+/* the SIGPROF handler of --sample */
+static void sample_tick(int signal_number);
+
+/* follows a LOADP at pc of segment seg_id to target on the trace, first 
+   taking the samples due */
+static void trace_loadp(UM_Mem memory, const uint32_t *registers, 
+                        uint32_t pc, uint32_t seg_id, uint32_t target);
+
+/* stops sampling and writes the samples to path, or with per_process to 
+   path.PID; frees the trace */
+static void write_samples(UM_Mem memory, const char *path, 
+                          bool per_process);
+
+/* segment 0 is replaced by segment seg_id, sharing its storage until one of
+   them is written */
 static inline void load_segment(UM_Mem memory, int seg_id); 
 
+/* gives segment seg_id storage of its own before it is written */
+static inline Array unshare_segment(UM_Mem memory, int seg_id);
+
+/* stores value at segment[seg_id][offset], keeping the predecoded and 
+   translated copies of segment 0 in step. Returns true if translated code 
+   was dropped */
+static inline bool store_word(UM_Mem memory, uint32_t seg_id, 
+                              uint32_t offset, uint32_t value);
+
+/* returns the fields of a 32-bit instruction word */
+static inline Decoded decode_word(uint32_t word);
+
+/* returns the superinstruction for the pair of words, or the opcode of 
+   first if they are not one */
+static inline uint8_t fuse(uint32_t first, uint32_t second);
+
+/* returns the opcode of the first word of a superinstruction, or opcode 
+   itself if it is not one */
+static inline uint8_t unfuse(uint8_t opcode);
+
+/* sets the handler of segment 0 word offset from it and the word after */
+static inline void fuse_at(UM_Mem memory, uint32_t offset);
+
+/* rebuilds the predecoded array after segment 0 is loaded or replaced, 
+   in the background if it is large and may be */
+static inline void decode_segment_0(UM_Mem memory, bool background);
+
+/* frees or unmaps the predecoded array */
+static void drop_decoded(UM_Mem memory);
+
+/* returns true if length records from a --code-cache file are ones 
+   decode_words() could have written */
+static bool decoded_valid(const Decoded *decoded, uint32_t length);
+
+/* predecodes length words into decoded, superinstructions and all */
+static void decode_words(const uint32_t *words, uint32_t length, 
+                         Decoded *decoded);
+
+/* hands the predecoding of the new segment 0 to a helper thread, which 
+   saves it in the code cache under key if cache_dir is not NULL */
+static void start_compile(UM_Mem memory, const char *cache_dir, 
+                          Cache_key key);
+
+/* the helper thread of --compile-thread, job is its Compile */
+static void *compile_main(void *job);
+
+/* notes a store into segment 0 at offset while the helper works */
+static void note_store(Compile *job, uint32_t offset);
+
+/* waits for the helper and puts its predecoded segment 0 in place */
+static void finish_compile(UM_Mem memory);
+
+/* runs segment 0 from its words until the helper has predecoded it, or 
+   it halts or runs off the end of segment 0 */
+static void run_cold(UM_Mem memory, uint32_t *registers, int *pc, 
+                     bool *halt_flag);
+
 /* returns the length of the segment associated with seg_id */
-static inline int segment_length(UM_Mem memory, int seg_id); 
+static inline uint32_t segment_length(UM_Mem memory, int seg_id); 
+
+/* returns the storage of a mapped segment, NULL if it is unmapped */
+static inline Array segment_storage(UM_Mem memory, uint32_t seg_id);
+
+/* points slot seg_id of the segment table at the storage */
+static inline void put_segment(UM_Mem memory, uint32_t seg_id, Array a);
+
+/* returns an unused slot of the segment table, reusing unmapped ones */
+static inline uint32_t new_slot(UM_Mem memory);
+
+/* returns a zeroed, cache line aligned segment table */
+static inline Segment *new_table(uint32_t capacity);
 
 /*prints out the sequence memory, and corresponding segments */
 static inline void print_mem_map(UM_Mem memory);
@@ -125,6 +554,54 @@ static inline void print_mem_map(UM_Mem memory);
 /* Runs the execution of the UM and UM instructions */ 
 static inline void execute (UM_Mem m); 
 
+#ifdef UM_PROFILE
+/* counts the instruction command at pc, which left the machine at next_pc 
+   with the given registers */
+static void profile_count (Profile *profile, uint32_t command, uint32_t pc,
+                           uint32_t next_pc, const uint32_t *registers);
+
+/* prints the counts sorted, with the instruction total and MIPS, to 
+   stderr and frees them */
+static void profile_report (Profile *profile);
+#endif
+
+/* Runs the UM with computed-goto threaded dispatch, registers kept in 
+   locals and every handler jumping straight to the next handler */
+static void execute_threaded (UM_Mem m);
+
+/* Runs the UM on translated x86-64 blocks, interpreting whatever the JIT 
+   leaves behind; falls back to execute_threaded() without a JIT */
+static void execute_jit (UM_Mem m);
+
+/* executes the instruction at *pc, one of those the JIT leaves to the 
+   interpreter */
+static void interpret_exit (UM_Mem m, uint32_t *registers, int *pc, 
+                            bool *halt_flag);
+
+/* Jit_runtime entry points, memory is the UM_Mem */
+static uint32_t jit_sstore (void *memory, uint32_t seg_id, uint32_t offset,
+                            uint32_t value);
+static uint32_t jit_map (void *memory, uint32_t num_words);
+static void jit_unmap (void *memory, uint32_t seg_id);
+
+/* Runs the blocks um_aot translated segment 0 into, interpreting what they
+   leave behind, and from the first pc they cannot run on goes on in 
+   execute_threaded() */
+static void execute_aot (UM_Mem m);
+
+/* Aot_runtime entry point for SSTORE, memory is the UM_Mem. A store into 
+   a word some block was translated from drops that block */
+static uint32_t aot_sstore (void *memory, uint32_t seg_id, uint32_t offset,
+                            uint32_t value);
+
+/* sets *engine from its command line name, returns false if unknown */
+static bool parse_engine (const char *name, Um_engine *engine);
+
+/* sets *flush, and *interval for a number of ms, from a --flush argument;
+   returns false if it is neither */
+static bool parse_flush (const char *name, Um_flush *flush, 
+                         uint64_t *interval);
+
 /* updates pc and returns the next 32 bit word instruction from segment 0 */ 
 static inline uint32_t get_instruction(UM_Mem m, int *pc); 
 
@@ -132,6 +609,12 @@ static inline uint32_t get_instruction(UM_Mem m, int *pc);
 static inline void handle_instruction (UM_Mem m, uint32_t encoded, 
                         uint32_t* registers, int *pc, bool *halt_flag); 
 
+/* executes d, the instruction before *pc; returns false if it is not one.
+   The one switch over the op helpers, every engine but the threaded one 
+   runs its instructions through it */
+static inline bool run_decoded (UM_Mem m, Decoded d, uint32_t *registers, 
+                                int *pc, bool *halt_flag);
+
 /* checks if register C is 0, if not then the contents of reg_b are 
    moved to reg_a */
 static inline void conditional_move(uint32_t* registers, uint32_t reg_a, 
@@ -175,167 +658,1840 @@ static inline void map_segment (UM_Mem m, uint32_t* registers, uint32_t reg_b,
 static inline void unmap_segment (UM_Mem m, uint32_t* registers, 
                              uint32_t reg_c); 
 
-/* value of reg_c is displayed on I/O device, 
-   only values 0 to 255 are allowed */ 
-static inline void output (uint32_t* registers, 
-                             uint32_t reg_c); 
+/* value of reg_c is displayed on I/O device, 
+   only values 0 to 255 are allowed */ 
+static inline void output (UM_Mem m, uint32_t* registers, 
+                             uint32_t reg_c); 
+
+/* UM waits for input on I/O device, reg_c is loaded with input which 
+must be a value from 0 to 255, if the end of input is signaled, reg_c is 
+loaded with a 32­bit word in which every bit is 1 */
+static inline void input (UM_Mem m, uint32_t* registers, 
+                             uint32_t reg_c); 
+
+/* segment [reg_b] is duplicated and duplicate replaces segment[0], 
+program counter is set to point to segment[0][reg_c] */
+static inline void load_program (UM_Mem m, uint32_t* registers, 
+                        uint32_t reg_b, uint32_t reg_c, int *pc);
+
+/* value is loaded into register a  */
+static inline void load_value (uint32_t* registers, 
+                             uint32_t reg_c, uint32_t value);
+
+
+#ifdef UM_LIBRARY
+/* libum.a keeps the command line as um_main(), the host has its own main */
+#define main um_main
+int um_main (int argc, char const *argv[]);
+#endif
+
+int main (int argc, char const *argv[])
+{
+    Um_engine engine = ENGINE_THREADED;
+    const char *filename = NULL;
+    const char *checkpoint_file = NULL;
+    bool checkpoint_at_load = false;
+    const char *snapshot_file = NULL;
+    const char *socket_path = NULL;
+    bool warm = false;
+    int out_fd = STDOUT_FILENO;
+    bool guard = false;
+    bool huge_pages = false;
+    Perf perf = NULL;
+    const char *sample_file = NULL;
+    bool compile_thread = false;
+    const char *cache_dir = NULL;
+    Um_flush flush = FLUSH_INPUT;
+    uint64_t interval = 0;
+#ifdef UM_PROFILE
+    bool profile = false;
+#endif
+
+    /* .um file must be the last command line argument ("-" for standard 
+       input), optionally preceded by --engine switch|threaded|jit and 
+       --checkpoint FILE, written at the first INPUT or with 
+       --checkpoint-at load the first LOADP of another segment. --restore 
+       FILE runs a checkpoint instead. 
+       --serve SOCKET [--warm] forks a run per connection. --flush 
+       input|line|MS sets when output is written, --output-fd FD where. 
+       --guard fences segments off with guard pages, --huge-pages asks for
+       transparent huge pages under them. --perf-counters reports hardware
+       counters of the engine's run, --sample FILE writes where it spent 
+       its time as folded stacks for a flame graph. --compile-thread 
+       predecodes segments loaded by LOADP on a helper thread, 
+       --code-cache DIR keeps predecoded segments for the next run. Built 
+       with -DUM_PROFILE (make um_profile) --profile is accepted too. 
+       Built with -DUM_ARENA (make um_arena) there is no segment table to
+       guard, checkpoint or compile against */
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            if (!parse_engine(argv[++i], &engine)) {
+                fprintf(stderr, "Unknown engine %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+#ifdef UM_PROFILE
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = true;
+#endif
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint_file = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-at") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "load") == 0) {
+                checkpoint_at_load = true;
+            } else if (strcmp(argv[i], "input") == 0) {
+                checkpoint_at_load = false;
+            } else {
+                fprintf(stderr, "Unknown checkpoint point %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            snapshot_file = argv[++i];
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--warm") == 0) {
+            warm = true;
+        } else if (strcmp(argv[i], "--flush") == 0 && i + 1 < argc) {
+            if (!parse_flush(argv[++i], &flush, &interval)) {
+                fprintf(stderr, "Unknown flush policy %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--output-fd") == 0 && i + 1 < argc) {
+            out_fd = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--guard") == 0) {
+            guard = true;
+        } else if (strcmp(argv[i], "--huge-pages") == 0) {
+            huge_pages = true;
+        } else if (strcmp(argv[i], "--perf-counters") == 0 
+                   && perf == NULL) {
+            perf = Perf_new();
+        } else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+            sample_file = argv[++i];
+        } else if (strcmp(argv[i], "--compile-thread") == 0) {
+            compile_thread = true;
+        } else if (strcmp(argv[i], "--code-cache") == 0 && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (filename == NULL) {
+            filename = argv[i];
+        } else {
+            filename = NULL;
+            break;
+        }
+    }
+    if ((filename == NULL) == (snapshot_file == NULL) 
+        || (warm && socket_path == NULL)) {
+        fprintf(stderr, "Incorrect input\n");
+        return EXIT_FAILURE;
+    }
+#ifdef UM_ARENA
+    if (guard || checkpoint_file != NULL || snapshot_file != NULL) {
+        fprintf(stderr, "um: --guard, --checkpoint and --restore need the "
+                        "segment table, not in an arena build\n");
+        return EXIT_FAILURE;
+    }
+    /* translated code and the helper read segments through the table */
+    if (engine == ENGINE_JIT) {
+        engine = ENGINE_THREADED;
+    }
+    compile_thread = false;
+#endif
+    /* initialize UM memory */
+    UM_Mem memory = new_memory();
+    /* without huge pages the plain page size arena is still used */
+    memory -> pool -> huge_pages = huge_pages && huge_pages_available();
+#ifdef UM_ARENA
+    /* the region was reserved with the memory, it only needs the advice */
+    if (memory -> pool -> huge_pages) {
+        advise_huge_pages(memory -> pool -> region, region_bytes);
+    }
+#else
+    if (guard || huge_pages) {
+        Pool_reserve(memory -> pool);
+    }
+#endif
+
+    memory -> cache_dir = cache_dir;
+    /* load .um program, or the machine it was checkpointed as */
+    if (snapshot_file != NULL) {
+        restore_snapshot(memory, snapshot_file);
+    } else {
+        load_instruction(memory, filename);
+    }
+    memory -> checkpoint_file = checkpoint_file;
+    memory -> checkpoint_at_load = checkpoint_at_load;
+#ifdef UM_PROFILE
+    /* only the switch engine counts */
+    memory -> profile = profile;
+    if (profile) {
+        engine = ENGINE_SWITCH;
+    }
+#endif
+    /* translated code jumps without telling anyone, the trace needs to 
+       see every LOADP */
+    if (sample_file != NULL && engine == ENGINE_JIT) {
+        engine = ENGINE_THREADED;
+    }
+    /* only the threaded engine runs from the predecoded copy and knows to 
+       wait for it. On one CPU the helper would only take turns with the 
+       engine, which then runs from the words, slower, for longer */
+    if (compile_thread && sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        fprintf(stderr, "um: one CPU, --compile-thread predecodes in line\n");
+        compile_thread = false;
+    }
+    memory -> compile_thread = compile_thread && engine == ENGINE_THREADED;
+    console_open(memory, out_fd, flush, interval);
+    if (guard) {
+        install_guard(memory);
+    }
+    /* serving, a child is forked per connection either right away or, 
+       warm, at the first INPUT. Output before that is held for each child
+       to send to its client */
+    if (socket_path != NULL) {
+        int listen_fd = open_server_socket(socket_path);
+        if (warm) {
+            memory -> console.holding = true;
+            memory -> listen_fd = listen_fd;
+        } else {
+            serve(listen_fd);
+        }
+    }
+    /* counted from here to the end of the run only */
+    if (perf != NULL) {
+        Perf_start(perf);
+    }
+    if (sample_file != NULL) {
+        start_sampling(memory);
+    }
+    if (engine == ENGINE_SWITCH) {
+        execute(memory);
+    } else if (engine == ENGINE_JIT) {
+        execute_jit(memory);
+    } else {
+        execute_threaded(memory);
+    }
+    if (perf != NULL) {
+        Perf_stop(perf);
+    }
+    console_close(memory);
+    if (memory -> checkpoint_file != NULL) {
+        fprintf(stderr, "um: halted before its first %s, %s was not "
+                "written\n", checkpoint_at_load ? "LOADP of another segment"
+                                                 : "INPUT", 
+                memory -> checkpoint_file);
+    }
+    if (sample_file != NULL) {
+        write_samples(memory, sample_file, socket_path != NULL);
+    }
+    if (perf != NULL) {
+        /* counted during the run itself, only a profiling build does */
+        if (memory -> instructions == 0) {
+#ifdef UM_PROFILE
+            fprintf(stderr, "um: the JIT does not count UM instructions, "
+                            "no per instruction figures\n");
+#else
+            fprintf(stderr, "um: only a -DUM_PROFILE build (make "
+                            "um_profile) counts UM instructions, no per "
+                            "instruction figures\n");
+#endif
+        }
+        Perf_report(perf, memory -> instructions, stderr);
+        Perf_free(&perf);
+    }
+    free_memory(memory);
+    return 0;
+}
+
+/* main() of a program um_aot wrote: runs the translated image on stdin 
+   and stdout */
+int Aot_main(int argc, char const *argv[], const Aot_program *program)
+{
+    if (argc != 1) {
+        fprintf(stderr, "usage: %s < input\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+#ifdef UM_ARENA
+    /* translated code reads segments through the table */
+    fprintf(stderr, "%s: libum.a was built with -DUM_ARENA\n", argv[0]);
+    return EXIT_FAILURE;
+#endif
+    UM_Mem memory = new_memory();
+    Array segment_0 = Pool_take(memory -> pool, program -> length);
+    Aot aot = { program, malloc(program -> length * sizeof(Aot_block *)), 
+                no_segment };
+
+    assert(aot.blocks != NULL || program -> length == 0);
+    memcpy(aot.blocks, program -> blocks, 
+           program -> length * sizeof(Aot_block *));
+    memcpy(segment_0 -> elems, program -> image, 
+           program -> length * sizeof(uint32_t));
+    put_segment(memory, new_slot(memory), segment_0);
+    decode_segment_0(memory, false);
+    memory -> aot = &aot;
+    console_open(memory, STDOUT_FILENO, FLUSH_INPUT, 0);
+    execute_aot(memory);
+    console_close(memory);
+    free_memory(memory);
+    free(aot.blocks);
+    return 0;
+}
+
+/* returns a machine about to run the big-endian .um image of size bytes,
+   which is copied */
+UM_Mem Um_new(const unsigned char *image, size_t size)
+{
+    UM_Mem m = new_memory();
+    Array segment_0 = Pool_take(m -> pool, size / 4);
+
+    swap_words(segment_0 -> elems, image, size / 4);
+    put_segment(m, new_slot(m), segment_0);
+    decode_segment_0(m, false);
+    m -> embedded = true;
+    return m;
+}
+
+/* runs at most budget instructions, with the registers and pc kept in the
+   machine between calls. An INPUT that would find the queue empty (before 
+   Um_end_input()) stops the run without executing. Instructions come 
+   from the predecoded copy of segment 0, one word at a time: a 
+   superinstruction only runs its first half, so the budget stays exact */
+Um_status Um_run(UM_Mem m, uint64_t budget)
+{
+    uint32_t *registers = m -> registers;
+    bool halt_called = m -> halted;
+    int pc = m -> pc;
+    Um_status status = UM_BUDGET_EXHAUSTED;
+    const Decoded *code = m -> decoded;
+    uint32_t length = segment_length(m, 0);
+    uint64_t given = budget;
+
+    while (budget > 0 && !halt_called) {
+        if ((uint32_t) pc >= length) {
+            status = UM_FAILED;
+            break;
+        }
+        Decoded d = code[pc];
+        d.opcode = unfuse(d.opcode);
+        if (d.opcode == INPUT && !(m -> end_of_input) 
+            && m -> input.start == m -> input.length) {
+            status = UM_NEEDS_INPUT;
+            break;
+        }
+        pc++;
+        if (!run_decoded(m, d, registers, &pc, &halt_called)) {
+            pc--;
+            status = UM_FAILED;
+            break;
+        }
+        if (d.opcode == LOADP) {
+            /* another segment 0 is predecoded somewhere else */
+            code = m -> decoded;
+            length = segment_length(m, 0);
+        }
+        budget--;
+    }
+    m -> instructions += given - budget;
+    m -> pc = pc;
+    m -> halted = halt_called;
+    return halt_called ? UM_HALTED : status;
+}
+
+/* queues size bytes for INPUT to read */
+void Um_put_input(UM_Mem m, const unsigned char *bytes, size_t size)
+{
+    queue_put(&(m -> input), bytes, size);
+}
+
+/* signals end of input: once the queue is empty INPUT reads all ones */
+void Um_end_input(UM_Mem m)
+{
+    m -> end_of_input = true;
+}
+
+/* moves up to size bytes of OUTPUT into bytes, returns how many */
+size_t Um_take_output(UM_Mem m, unsigned char *bytes, size_t size)
+{
+    return queue_take(&(m -> output), bytes, size);
+}
+
+/* returns the number of instructions the machine has retired */
+uint64_t Um_instructions(UM_Mem m)
+{
+    return m -> instructions;
+}
+
+/* frees the machine and sets *m to NULL */
+void Um_free(UM_Mem *m)
+{
+    free_memory(*m);
+    *m = NULL;
+}
+
+/* sets *engine from its command line name, returns false if unknown */
+static bool parse_engine (const char *name, Um_engine *engine)
+{
+    if (strcmp(name, "switch") == 0) {
+        *engine = ENGINE_SWITCH;
+    } else if (strcmp(name, "threaded") == 0) {
+        *engine = ENGINE_THREADED;
+    } else if (strcmp(name, "jit") == 0) {
+        *engine = ENGINE_JIT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* sets *flush, and *interval for a number of ms, from a --flush argument;
+   returns false if it is neither */
+static bool parse_flush (const char *name, Um_flush *flush, 
+                         uint64_t *interval)
+{
+    char *end;
+
+    if (strcmp(name, "input") == 0) {
+        *flush = FLUSH_INPUT;
+    } else if (strcmp(name, "line") == 0) {
+        *flush = FLUSH_LINE;
+    } else {
+        unsigned long ms = strtoul(name, &end, 10);
+        if (end == name || *end != '\0') {
+            return false;
+        }
+        *flush = FLUSH_TIMED;
+        *interval = (uint64_t) ms * 1000000;
+    }
+    return true;
+}
+
+
+/* returns a new UM_Mem with an empty segment table */
+static inline UM_Mem new_memory()
+{
+    UM_Mem mem = malloc (sizeof(*mem)); 
+
+    mem -> capacity = cache_line;
+    mem -> segments = new_table(mem -> capacity);
+    mem -> num_segments = 0;
+    mem -> table_reserved = false;
+    mem -> free_head = no_segment;
+    mem -> pool = Pool_new ();
+#ifdef UM_ARENA
+    /* carved first, segment 0 sits at the start of the arena for good and
+       is never freed, like storage in a snapshot */
+    Pool_reserve(mem -> pool);
+    Array segment_0 = Pool_carve(mem -> pool, 
+                                 Array_bytes(arena_segment_0));
+    segment_0 -> length = 0;
+    segment_0 -> refs = 1;
+    segment_0 -> size_class = mapped_class;
+    mem -> arena = segment_0 -> elems;
+#endif
+    mem -> decoded = NULL;
+    mem -> decoded_mapped = 0;
+    mem -> cache_dir = NULL;
+    mem -> jit = NULL;
+    mem -> aot = NULL;
+    memset(mem -> registers, 0, sizeof(mem -> registers));
+    mem -> pc = 0;
+    mem -> checkpoint_file = NULL;
+    mem -> checkpoint_at_load = false;
+    mem -> listen_fd = -1;
+    mem -> snapshot = NULL;
+    mem -> snapshot_size = 0;
+#ifdef UM_PROFILE
+    mem -> profile = false;
+#endif
+    mem -> embedded = false;
+    memset(&(mem -> input), 0, sizeof(mem -> input));
+    memset(&(mem -> output), 0, sizeof(mem -> output));
+    mem -> end_of_input = false;
+    mem -> halted = false;
+    mem -> instructions = 0;
+    memset(&(mem -> console), 0, sizeof(mem -> console));
+    mem -> running_registers = NULL;
+    mem -> trace = NULL;
+    mem -> compile_thread = false;
+    mem -> compiling = NULL;
+
+    return mem; 
+}
+
+/* frees all associated memory in the UM_mem */
+static inline void free_memory(UM_Mem m)
+{
+    Array temp = NULL;
+    if (m -> compiling != NULL) {
+            finish_compile(m);
+    }
+    /* free the storage of every mapped segment */
+    for (uint32_t i = 0; i < m -> num_segments; i++){
+            temp = segment_storage (m, i);
+            if (temp != NULL) {
+                    Array_release (m -> pool, &temp);
+            }
+    }
+
+    if (m -> table_reserved) {
+            munmap (m -> segments, table_reserve_bytes);
+    } else {
+            free (m -> segments);
+    }
+    Pool_free (&(m -> pool));
+    if (m -> snapshot != NULL) {
+            munmap (m -> snapshot, m -> snapshot_size);
+    }
+    drop_decoded(m);
+    free(m -> input.bytes);
+    free(m -> output.bytes);
+    free(m);
+}
+
+/* creates a segment in UM_mem capable of holding num_words, 32-bit words and 
+   returns seg_id */
+static inline uint32_t map_seg(UM_Mem m, uint32_t num_words)
+{
+    /* takes storage for num_words from the pool, zeroed */
+    Array segment = Array_new(m -> pool, num_words);
+#ifdef UM_ARENA
+    /* the id is where it is */
+    return segment -> elems - m -> arena;
+#else
+    uint32_t index = new_slot(m);
+
+    put_segment(m, index, segment);
+    return index;
+#endif
+} 
+
+/* threads the slot onto the unmapped list to be reused and hands its 
+   storage back to the pool right away */
+static inline void unmap_seg(UM_Mem m, int seg_id)
+{
+#ifdef UM_ARENA
+    /* there is no slot, the id comes back with the storage */
+    Array segment = segment_storage(m, seg_id);
+
+    Array_release(m -> pool, &segment);
+#else
+    assert ((uint32_t) seg_id < m -> num_segments);
+
+    Array segment = segment_storage (m, seg_id);
+
+    if (segment != NULL){   
+            Array_release (m -> pool, &segment);
+            m -> segments[seg_id].words = NULL;
+            m -> segments[seg_id].length = 0;
+            m -> segments[seg_id].next_free = m -> free_head;
+            m -> free_head = seg_id;
+    }
+#endif
+} 
+
+/* returns address of a particular offset in a particular segment in memory */
+static inline uint32_t* mem_address(UM_Mem m, int seg_id, uint32_t offset)
+{       
+#ifdef UM_ARENA
+    return m -> arena + (uint32_t) seg_id + offset;
+#else
+    return &(m -> segments[seg_id].words[offset]);
+#endif
+} 
+
+/* returns the storage of a mapped segment, NULL if it is unmapped (in an
+   arena build whatever is at that id) */
+static inline Array segment_storage(UM_Mem m, uint32_t seg_id)
+{
+#ifdef UM_ARENA
+    return Array_of(m -> arena + seg_id);
+#else
+    uint32_t *words = m -> segments[seg_id].words;
+    return words == NULL ? NULL : Array_of(words);
+#endif
+}
+
+/* points slot seg_id of the segment table at the storage. In an arena 
+   build only segment 0 has a slot, always pointing at the start of the
+   arena: the words are copied there and the storage released */
+static inline void put_segment(UM_Mem m, uint32_t seg_id, Array a)
+{
+#ifdef UM_ARENA
+    Array segment_0 = Array_of(m -> arena);
+
+    assert(seg_id == 0);
+    if (a != segment_0) {
+        if (Array_length(a) > arena_segment_0) {
+            fprintf(stderr, "um: segment 0 of %" PRIu32 " words does not "
+                    "fit in the arena\n", Array_length(a));
+            exit(EXIT_FAILURE);
+        }
+        memcpy(segment_0 -> elems, a -> elems, 
+               (size_t) Array_length(a) * sizeof(uint32_t));
+        segment_0 -> length = Array_length(a);
+        Array_release(m -> pool, &a);
+        a = segment_0;
+    }
+#endif
+    m -> segments[seg_id].words = a -> elems;
+    m -> segments[seg_id].length = Array_length(a);
+}
+
+/* returns a zeroed, cache line aligned segment table. Slots past 
+   num_segments read as unmapped, so --guard catches ids up to capacity, 
+   and past that in the reservation reserve_table() moves it to */
+static inline Segment *new_table(uint32_t capacity)
+{
+    void *table = NULL;
+    int failed = posix_memalign(&table, cache_line, 
+                                capacity * sizeof(Segment));
+    assert(!failed);
+    (void) failed;
+    memset(table, 0, capacity * sizeof(Segment));
+    return table;
+}
+
+/* returns an unused slot of the segment table, reusing unmapped ones and
+   doubling the table when it is full */
+static inline uint32_t new_slot(UM_Mem m)
+{
+    uint32_t index = m -> free_head;
+
+    if (index != no_segment) {
+        m -> free_head = m -> segments[index].next_free;
+        return index;
+    }
+    if (m -> num_segments == m -> capacity && m -> table_reserved) {
+        /* fresh pages of the reservation are zero, unmapped slots */
+        int failed = mprotect(m -> segments, 2 * (size_t) m -> capacity 
+                                             * sizeof(Segment), 
+                              PROT_READ | PROT_WRITE);
+        assert(!failed);
+        (void) failed;
+        m -> capacity *= 2;
+    } else if (m -> num_segments == m -> capacity) {
+        Segment *bigger = new_table(2 * m -> capacity);
+        memcpy(bigger, m -> segments, 
+               m -> num_segments * sizeof(*bigger));
+        free(m -> segments);
+        m -> segments = bigger;
+        m -> capacity *= 2;
+    }
+    return m -> num_segments++;
+}
+
+/* loads the big-endian .um image into segment 0, "-" is standard input. 
+   A regular file is mmap'd, anything else (a pipe, a terminal) is read in 
+   large chunks; either way the words are byte swapped in bulk */
+static inline void load_instruction(UM_Mem m, const char* filename) 
+{ 
+    bool from_stdin = strcmp(filename, "-") == 0;
+    int fd = from_stdin ? STDIN_FILENO : open(filename, O_RDONLY);
+    assert (fd >= 0);
+
+    struct stat file_info; 
+    int failed = fstat(fd, &file_info);
+    assert (!failed);
+    (void) failed;
+
+    Array segment_0;
+    if (S_ISREG(file_info.st_mode)) {
+        size_t size = file_info.st_size;
+        int num_instructions = size / 4; 
+
+        segment_0 = Pool_take(m -> pool, num_instructions);
+        if (num_instructions > 0) {
+            unsigned char *image = mmap(NULL, size, PROT_READ, 
+                                        MAP_PRIVATE | MAP_POPULATE, fd, 0);
+            assert (image != MAP_FAILED);
+            swap_words(segment_0 -> elems, image, num_instructions);
+            munmap(image, size);
+        }
+    } else {
+        size_t size;
+        unsigned char *image = read_image(fd, &size);
+
+        segment_0 = Pool_take(m -> pool, size / 4);
+        swap_words(segment_0 -> elems, image, size / 4);
+        free(image);
+    }
+    if (!from_stdin) {
+        close(fd);
+    }
+    put_segment (m, new_slot(m), segment_0);
+    decode_segment_0(m, false);
+}
+
+/* reads fd to its end, returns the bytes and sets *size */
+static unsigned char *read_image(int fd, size_t *size)
+{
+    size_t capacity = read_chunk;
+    unsigned char *image = malloc(capacity);
+    assert (image != NULL);
+
+    *size = 0;
+    for (;;) {
+        if (capacity - *size < read_chunk) {
+            capacity *= 2;
+            image = realloc(image, capacity);
+            assert (image != NULL);
+        }
+        ssize_t n = read(fd, image + *size, capacity - *size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        assert (n >= 0);
+        if (n == 0) {
+            return image;
+        }
+        *size += n;
+    }
+}
+
+#if defined(__x86_64__)
+/* swap_words() sixteen bytes at a time with one pshufb */
+__attribute__((target("ssse3")))
+static void swap_words_ssse3(uint32_t *words, const unsigned char *image, 
+                             size_t num_words)
+{
+    const __m128i order = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 
+                                       4, 5, 6, 7, 0, 1, 2, 3);
+    size_t i = 0;
+
+    for (; i + 4 <= num_words; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (image + 4 * i));
+        _mm_storeu_si128((__m128i *) (words + i), 
+                         _mm_shuffle_epi8(v, order));
+    }
+    for (; i < num_words; i++) {
+        uint32_t word;
+        memcpy(&word, image + 4 * i, sizeof(word));
+        words[i] = ntohl(word);
+    }
+}
+#endif
+
+/* copies num_words big-endian words from image into words in host order */
+static void swap_words(uint32_t *words, const unsigned char *image, 
+                       size_t num_words)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("ssse3")) {
+        swap_words_ssse3(words, image, num_words);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < num_words; i++) {
+        uint32_t word;
+        memcpy(&word, image + 4 * i, sizeof(word));
+        words[i] = ntohl(word);
+    }
+}
+
+/* called before a LOADP of another segment while a checkpoint is still to
+   be written, writes it if that is where it was asked for. Programs that 
+   unpack themselves and never read (sandmark) get theirs here */
+static inline void before_load(UM_Mem m, const uint32_t *registers, 
+                               uint32_t pc)
+{
+    if (m -> checkpoint_at_load) {
+        write_checkpoint(m, registers, pc);
+        m -> checkpoint_file = NULL;
+    }
+}
+
+/* called before every INPUT, checkpoints the first one if asked to */
+static inline void before_input(UM_Mem m, const uint32_t *registers, 
+                                uint32_t pc)
+{
+    if (m -> checkpoint_file != NULL && !m -> checkpoint_at_load) {
+        write_checkpoint(m, registers, pc);
+        m -> checkpoint_file = NULL;
+    }
+    if (m -> listen_fd >= 0) {
+        /* the helper would not be forked with the rest */
+        if (m -> compiling != NULL) {
+            finish_compile(m);
+        }
+        serve(m -> listen_fd);
+        m -> listen_fd = -1;
+        m -> console.holding = false;
+        if (m -> trace != NULL) {
+            start_sampling(m);
+        }
+    }
+}
+
+/* returns a Unix socket listening at path, replacing any file there */
+static int open_server_socket(const char *path)
+{
+    struct sockaddr_un address;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (fd < 0 || strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Cannot serve on %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0 
+        || listen(fd, SOMAXCONN) != 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/* accepts connections on listen_fd forever, forking for each. The child 
+   inherits the whole machine copy-on-write (segments, predecoded and 
+   translated code, the engine's registers and pc) and goes back to 
+   running it, so a request costs a fork and not a load. Children are 
+   never waited for */
+static void serve(int listen_fd)
+{
+    signal(SIGCHLD, SIG_IGN);
+    for (;;) {
+        int connection = accept(listen_fd, NULL, NULL);
+        if (connection < 0) {
+            assert(errno == EINTR || errno == ECONNABORTED);
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(listen_fd);
+            dup2(connection, STDIN_FILENO);
+            dup2(connection, STDOUT_FILENO);
+            close(connection);
+            signal(SIGCHLD, SIG_DFL);
+            return;
+        }
+        if (pid < 0) {
+            perror("fork");
+        }
+        close(connection);
+    }
+}
+
+/* starts console I/O, output going to out_fd */
+static void console_open(UM_Mem m, int out_fd, Um_flush flush, 
+                         uint64_t interval)
+{
+    Console *console = &(m -> console);
+
+    console -> out = malloc(console_buffer);
+    console -> in = malloc(console_buffer);
+    assert(console -> out != NULL && console -> in != NULL);
+    console -> out_fd = out_fd;
+    console -> flush = flush;
+    console -> interval = interval;
+    console -> last_flush = now_ns();
+}
+
+/* writes the held and buffered output to out_fd in one writev(). While 
+   holding (--serve --warm before the fork) it is moved to held instead, 
+   which grows as needed, so every child starts by sending its client 
+   all the output from before the first INPUT */
+static void console_flush(UM_Mem m)
+{
+    Console *console = &(m -> console);
+    Byte_queue *held = &(console -> held);
+
+    console -> writing = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if (console -> holding) {
+        queue_put(held, console -> out, console -> out_length);
+        console -> out_length = 0;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        console -> writing = 0;
+        return;
+    }
+    struct iovec buffers[2];
+    int count = 0;
+    if (held -> bytes != NULL) {
+        buffers[count].iov_base = held -> bytes + held -> start;
+        buffers[count++].iov_len = held -> length - held -> start;
+    }
+    buffers[count].iov_base = console -> out;
+    buffers[count++].iov_len = console -> out_length;
+    write_all(console -> out_fd, buffers, count);
+    if (held -> bytes != NULL) {
+        free(held -> bytes);
+        memset(held, 0, sizeof(*held));
+    }
+    console -> out_length = 0;
+    if (console -> flush == FLUSH_TIMED) {
+        console -> last_flush = now_ns();
+    }
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    console -> writing = 0;
+}
+
+/* writes the remaining output and frees the console buffers */
+static void console_close(UM_Mem m)
+{
+    Console *console = &(m -> console);
+
+    if (console -> out == NULL) {
+        return;
+    }
+    console -> holding = false;
+    console_flush(m);
+    free(console -> out);
+    free(console -> in);
+    console -> out = NULL;
+    console -> in = NULL;
+}
+
+/* refills the input buffer with one read(), returns false at the end of 
+   input. Output is written first, an interactive user or a program on 
+   the other end of a pipe may need to see it before sending more */
+static bool console_fill(UM_Mem m)
+{
+    Console *console = &(m -> console);
+    ssize_t n;
+
+    if (console -> end_of_input) {
+        return false;
+    }
+    if (console -> out_length > 0 || console -> held.bytes != NULL) {
+        console_flush(m);
+    }
+    do {
+        n = read(STDIN_FILENO, console -> in, console_buffer);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        console -> end_of_input = true;
+        return false;
+    }
+    console -> in_start = 0;
+    console -> in_length = n;
+    return true;
+}
+
+/* writes count buffers to fd, whatever it takes: writev() may stop short
+   on a pipe or socket */
+static void write_all(int fd, struct iovec *buffers, int count)
+{
+    while (count > 0) {
+        ssize_t n = writev(fd, buffers, count);
+        if (n < 0) {
+            assert(errno == EINTR);
+            continue;
+        }
+        while (count > 0 && (size_t) n >= buffers -> iov_len) {
+            n -= buffers -> iov_len;
+            buffers++;
+            count--;
+        }
+        if (count > 0) {
+            buffers -> iov_base = (char *) buffers -> iov_base + n;
+            buffers -> iov_len -= n;
+        }
+    }
+}
+
+/* returns monotonic time in ns. The coarse clock is read from the vDSO 
+   without a system call, and a few ms of error is nothing to a flush 
+   interval */
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* writes what output there is and exits, on an invalid instruction */
+static void fail(UM_Mem m)
+{
+    console_close(m);
+    exit(1);
+}
+
+/* returns false, saying why on stderr, if the kernel will not back 
+   madvise()d memory with transparent huge pages: it has none, or they 
+   are set to never */
+static bool huge_pages_available(void)
+{
+    char setting[128] = "";
+    FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+
+    if (fp != NULL) {
+        if (fgets(setting, sizeof(setting), fp) == NULL) {
+            setting[0] = '\0';
+        }
+        fclose(fp);
+    }
+    if (strstr(setting, "[always]") == NULL 
+        && strstr(setting, "[madvise]") == NULL) {
+        fprintf(stderr, "um: no transparent huge pages, "
+                        "--huge-pages uses normal pages\n");
+        return false;
+    }
+    return true;
+}
+
+/* the machine guard_fault() reports on; a signal handler has no other 
+   way to it */
+static UM_Mem guarded_memory = NULL;
+
+/* makes a fault on a guard page or an unmapped segment of memory a UM 
+   failure with a report, for --guard. SLOAD and SSTORE stay unchecked, 
+   the MMU does the checking */
+static void install_guard(UM_Mem m)
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = guard_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    guarded_memory = m;
+    reserve_table(m);
+    int failed = sigaction(SIGSEGV, &action, NULL);
+    assert(!failed);
+    (void) failed;
+}
+
+/* moves the segment table to the start of a PROT_NONE reservation with a
+   slot for every 32-bit id, usable up to capacity and grown in place by 
+   new_slot(). An id past the table then faults in the reservation, where
+   guard_fault() can tell which one it was */
+static void reserve_table(UM_Mem m)
+{
+    Segment *table = mmap(NULL, table_reserve_bytes, PROT_NONE, 
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, 
+                          -1, 0);
+    assert(table != MAP_FAILED);
+    int failed = mprotect(table, (size_t) m -> capacity * sizeof(Segment),
+                          PROT_READ | PROT_WRITE);
+    assert(!failed);
+    (void) failed;
+    memcpy(table, m -> segments, m -> num_segments * sizeof(Segment));
+    free(m -> segments);
+    m -> segments = table;
+    m -> table_reserved = true;
+}
+
+/* the SIGSEGV handler of --guard. A fault in the guard after a large 
+   segment, or after the region of the small ones, names the segment and 
+   offset; one at an address a NULL words pointer 
+   plus a 32-bit offset can make (or a refs check just below it) is an 
+   unmapped segment, offset unknown, and one in the table's reservation 
+   past capacity an id that never was. The pc is found by looking for the
+   SLOAD, SSTORE or LOADP in segment 0 that makes that access with the 
+   registers the fault left, which are in the JIT's host registers while 
+   translated code runs. Any other fault is not the UM program's: the 
+   default action is put back and the fault happens again. Only 
+   async-signal-safe calls are made, output is written with write() and 
+   only if the fault did not stop OUTPUT halfway */
+static void guard_fault(int signal_number, siginfo_t *info, void *context)
+{
+    UM_Mem m = guarded_memory;
+    uintptr_t address = (uintptr_t) info -> si_addr;
+    uint32_t seg_id = no_segment;
+    uint64_t offset = UINT64_MAX;
+    const uint32_t *registers = m -> running_registers;
+    char report[512];
+    int length;
+
+    Pool pool = m -> pool;
+    uintptr_t region = (uintptr_t) pool -> region;
+    bool past_region = address >= region + pool -> region_usable 
+                       && address < region + region_bytes;
+    uintptr_t nearest = 0;
+    uintptr_t table = (uintptr_t) m -> segments;
+    bool past_table = m -> table_reserved && address >= table 
+                      && address < table + table_reserve_bytes;
+
+    /* the segment whose guard it is: a large one's own, or the region's 
+       for the mapped segment carved last before it */
+    for (uint32_t i = 0; i < m -> num_segments; i++) {
+        uintptr_t words = (uintptr_t) m -> segments[i].words;
+        uintptr_t end = words + (size_t) m -> segments[i].length 
+                                * sizeof(uint32_t);
+        if (words == 0 || words > address || words < nearest) {
+            continue;
+        }
+        if ((past_region && words >= region) 
+            || (address >= end && address < end + guard_bytes 
+                && Array_of((uint32_t *) words) -> size_class 
+                   == guarded_class)) {
+            seg_id = i;
+            nearest = words;
+            offset = (address - words) / sizeof(uint32_t);
+        }
+    }
+    if (seg_id == no_segment && !past_table
+        && address > ((uintptr_t) UINT32_MAX + 1) * sizeof(uint32_t)
+        && address < (uintptr_t) -cache_line) {
+        signal(signal_number, SIG_DFL);
+        return;
+    }
+    if (m -> jit != NULL) {
+        registers = NULL;
+#if defined(__x86_64__) && defined(REG_R8)
+        static uint32_t host[8];
+        greg_t *gregs = ((ucontext_t *) context) -> uc_mcontext.gregs;
+        if (Jit_owns(m -> jit, (void *) gregs[REG_RIP])) {
+            for (int i = 0; i < 8; i++) {
+                host[i] = gregs[REG_R8 + i];
+            }
+            registers = host;
+        }
+#endif
+    }
+    (void) context;
+
+    if (seg_id != no_segment) {
+        length = append_text(report, 0, sizeof(report), "um: offset ");
+        length = append_number(report, length, sizeof(report), offset);
+        length = append_text(report, length, sizeof(report), 
+                             " is past the end of segment ");
+        length = append_number(report, length, sizeof(report), seg_id);
+        length = append_text(report, length, sizeof(report), " (");
+        length = append_number(report, length, sizeof(report), 
+                               m -> segments[seg_id].length);
+        length = append_text(report, length, sizeof(report), " words)");
+    } else if (past_table) {
+        length = append_text(report, 0, sizeof(report), 
+                             "um: access to unmapped segment ");
+        length = append_number(report, length, sizeof(report), 
+                               (address - table) / sizeof(Segment));
+    } else {
+        length = append_text(report, 0, sizeof(report), 
+                             "um: access to an unmapped segment");
+    }
+    if (registers != NULL) {
+        length = append_fault_pcs(m, registers, seg_id, offset, report, 
+                                  length, sizeof(report));
+    }
+    length = append_text(report, length, sizeof(report), "\n");
+
+    Console *console = &(m -> console);
+    if (console -> out != NULL && !console -> writing 
+        && !console -> holding) {
+        Byte_queue *held = &(console -> held);
+        if (held -> bytes != NULL) {
+            write_raw(console -> out_fd, held -> bytes + held -> start, 
+                      held -> length - held -> start);
+        }
+        write_raw(console -> out_fd, console -> out, console -> out_length);
+    }
+    write_raw(STDERR_FILENO, report, length);
+    _exit(EXIT_FAILURE);
+}
+
+/* appends text to report at length, as much as fits with a terminating 
+   NUL in size, returns the new length */
+static int append_text(char *report, int length, size_t size, 
+                       const char *text)
+{
+    while (*text != '\0' && (size_t) length + 1 < size) {
+        report[length++] = *text++;
+    }
+    report[length] = '\0';
+    return length;
+}
+
+/* appends n in decimal to report at length, returns the new length */
+static int append_number(char *report, int length, size_t size, 
+                         uint64_t n)
+{
+    char digits[21];
+    int i = sizeof(digits) - 1;
+
+    digits[i] = '\0';
+    do {
+        digits[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    return append_text(report, length, size, digits + i);
+}
+
+/* writes size bytes to fd with write() alone, from a signal handler; 
+   gives up on an error, there is no one left to tell */
+static void write_raw(int fd, const void *bytes, size_t size)
+{
+    const char *next = bytes;
+
+    while (size > 0) {
+        ssize_t n = write(fd, next, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        next += n;
+        size -= n;
+    }
+}
+
+/* appends to report the pc of each segment 0 instruction that accesses 
+   segment seg_id (no_segment: any unmapped one) at offset (UINT64_MAX: 
+   any) given registers, returns the new length. Usually there is one */
+static int append_fault_pcs(UM_Mem m, const uint32_t *registers, 
+                            uint32_t seg_id, uint64_t offset, char *report,
+                            int length, size_t size)
+{
+    const uint32_t *code = m -> segments[0].words;
+    const char *separator = " at pc ";
+    int found = 0;
+
+    for (uint32_t pc = 0; pc < m -> segments[0].length && found < 4; pc++) {
+        Decoded d = decode_word(code[pc]);
+        uint32_t target;
+        uint64_t at = offset;
+
+        if (d.opcode == SLOAD) {
+            target = registers[d.reg_b];
+            at = registers[d.reg_c];
+        } else if (d.opcode == SSTORE) {
+            target = registers[d.reg_a];
+            at = registers[d.reg_b];
+        } else if (d.opcode == LOADP && seg_id == no_segment) {
+            target = registers[d.reg_b];
+        } else {
+            continue;
+        }
+        bool unmapped = target >= m -> num_segments 
+                        || m -> segments[target].words == NULL;
+        if ((seg_id == no_segment ? unmapped : target == seg_id) 
+            && (offset == UINT64_MAX || at == offset)) {
+            length = append_text(report, length, size, separator);
+            length = append_number(report, length, size, pc);
+            separator = ", ";
+            found++;
+        }
+    }
+    if (found == 0) {
+        length = append_text(report, length, size, " (pc not found)");
+    }
+    return length;
+}
+
+/* ticks of CPU time sample_tick() has counted and no LOADP has taken 
+   yet. A signal handler can do no more than that safely, so a tick is 
+   turned into a sample at the next LOADP, which ends the stretch of code 
+   that was running when it came */
+static volatile sig_atomic_t samples_due = 0;
+
+/* starts --sample taking samples: a SIGPROF every 1/sample_hz s of CPU 
+   time the process uses, so a machine waiting for input is not sampled.
+   Engines only look at the trace on a LOADP, which costs them one 
+   predictable branch there when not sampling */
+static void start_sampling(UM_Mem m)
+{
+    struct sigaction action;
+    struct itimerval timer;
+    int failed;
+
+    if (m -> trace == NULL) {
+        m -> trace = calloc(1, sizeof(Trace));
+        assert(m -> trace != NULL);
+        m -> trace -> samples = Samples_new();
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sample_tick;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    failed = sigaction(SIGPROF, &action, NULL);
+    assert(!failed);
+
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / sample_hz;
+    timer.it_value = timer.it_interval;
+    failed = setitimer(ITIMER_PROF, &timer, NULL);
+    assert(!failed);
+    (void) failed;
+}
+
+/* the SIGPROF handler of --sample */
+static void sample_tick(int signal_number)
+{
+    (void) signal_number;
+    samples_due++;
+}
+
+/* follows a LOADP at pc of segment seg_id to target on the trace, first 
+   taking the samples due at pc under the calls on the trace. Loading 
+   another segment starts a new program with an empty trace. In segment 0
+   a LOADP to where a call on the trace returns to pops back to it, or 
+   with a register holding pc + 1, the usual way to pass a return address, 
+   is a call; any other is a jump, which leaves the trace as it is */
+static void trace_loadp(UM_Mem m, const uint32_t *registers, uint32_t pc, 
+                        uint32_t seg_id, uint32_t target)
+{
+    Trace *trace = m -> trace;
+
+    if (samples_due > 0) {
+        sig_atomic_t due = samples_due;
+        samples_due = 0;
+        Samples_add(trace -> samples, trace -> loads, trace -> calls, 
+                    trace -> depth, pc, due);
+    }
+    if (seg_id != 0) {
+        trace -> depth = 0;
+        trace -> loads++;
+        return;
+    }
+    for (int i = trace -> depth - 1; i >= 0; i--) {
+        if (trace -> returns[i] == target) {
+            trace -> depth = i;
+            return;
+        }
+        if (trace -> calls[i] == target) {
+            trace -> depth = i + 1;
+            return;
+        }
+    }
+    if (target == pc + 1) {
+        return;
+    }
+    for (int r = 0; r < 8; r++) {
+        if (registers[r] == pc + 1) {
+            if (trace -> depth == trace_depth) {
+                return;
+            }
+            trace -> calls[trace -> depth] = target;
+            trace -> returns[trace -> depth] = pc + 1;
+            trace -> depth++;
+            return;
+        }
+    }
+}
+
+/* stops sampling and writes the samples to path, or with per_process to 
+   path.PID, so the children of --serve each write their own; frees the 
+   trace */
+static void write_samples(UM_Mem m, const char *path, bool per_process)
+{
+    struct itimerval timer;
+    char name[4096];
+
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    if (per_process) {
+        snprintf(name, sizeof(name), "%s.%d", path, (int) getpid());
+        path = name;
+    }
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror(path);
+    } else {
+        Samples_write(m -> trace -> samples, fp);
+        fclose(fp);
+    }
+    Samples_free(&(m -> trace -> samples));
+    free(m -> trace);
+    m -> trace = NULL;
+}
+
+/* writes the machine, stopped at the INPUT or LOADP at pc, to 
+   m->checkpoint_file. Storage shared by two slots (segment 0 and the 
+   segment it was loaded from) is written once. A checkpoint that cannot
+   be written in full fails the run, nothing would say it was missing */
+static void write_checkpoint(UM_Mem m, const uint32_t *registers, 
+                             uint32_t pc)
+{
+    FILE *fp = fopen(m -> checkpoint_file, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "um: %s: %s, no checkpoint written\n", 
+                m -> checkpoint_file, strerror(errno));
+        fail(m);
+    }
+
+    Snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+    memcpy(header.registers, registers, sizeof(header.registers));
+    header.pc = pc;
+    header.num_segments = m -> num_segments;
+    header.free_head = m -> free_head;
+    fwrite(&header, sizeof(header), 1, fp);
+
+    /* lay the storage out after the slots, the only storage two slots can
+       share is segment 0's */
+    Array seg_0 = segment_storage(m, 0);
+    uint64_t seg_0_offset = 0;
+    uint64_t offset = sizeof(header) 
+                      + m -> num_segments * sizeof(Snapshot_slot);
+    for (uint32_t i = 0; i < m -> num_segments; i++) {
+        Array segment = segment_storage(m, i);
+        Snapshot_slot slot = { 0, m -> segments[i].next_free, 0 };
+
+        if (i > 0 && segment == seg_0) {
+            slot.offset = seg_0_offset;
+        } else if (segment != NULL) {
+            offset = (offset + snapshot_align - 1) 
+                     & ~(uint64_t) (snapshot_align - 1);
+            slot.offset = offset;
+            offset += sizeof(*segment) 
+                      + Array_length(segment) * sizeof(uint32_t);
+        }
+        if (i == 0) {
+            seg_0_offset = slot.offset;
+        }
+        fwrite(&slot, sizeof(slot), 1, fp);
+    }
+
+    static const char padding[snapshot_align];
+    for (uint32_t i = 0; i < m -> num_segments; i++) {
+        Array segment = segment_storage(m, i);
+        if (segment == NULL || (i > 0 && segment == seg_0)) {
+            continue;
+        }
+        long at = ftell(fp);
+        fwrite(padding, (snapshot_align - at % snapshot_align) 
+                        % snapshot_align, 1, fp);
+        fwrite(segment, sizeof(*segment) 
+                        + Array_length(segment) * sizeof(uint32_t), 1, fp);
+    }
+    bool failed = ferror(fp) != 0;
+    if (fclose(fp) != 0 || failed) {
+        fprintf(stderr, "um: %s: %s, checkpoint not written in full\n", 
+                m -> checkpoint_file, strerror(errno));
+        fail(m);
+    }
+}
+
+/* replaces the empty machine with the one checkpointed to filename. The 
+   file is mapped privately and the segment table points into it, so only 
+   the pages a run touches are read, and written pages are copied rather 
+   than written back. Every offset and free list link is checked first, a
+   short or corrupt file is refused rather than followed */
+static void restore_snapshot(UM_Mem m, const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Cannot open snapshot %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    size_t size = st.st_size;
+    unsigned char *image = MAP_FAILED;
+    if (size >= sizeof(Snapshot_header)) {
+        image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, 
+                     fd, 0);
+    }
+    close(fd);
+
+    Snapshot_header header;
+    if (image != MAP_FAILED) {
+        memcpy(&header, image, sizeof(header));
+    }
+    if (image == MAP_FAILED 
+        || memcmp(header.magic, snapshot_magic, sizeof(header.magic)) != 0
+        || (size - sizeof(header)) / sizeof(Snapshot_slot) 
+           < header.num_segments) {
+        fprintf(stderr, "Bad snapshot %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    m -> snapshot = image;
+    m -> snapshot_size = size;
+
+    while (m -> capacity < header.num_segments) {
+        m -> capacity *= 2;
+    }
+    free(m -> segments);
+    m -> segments = new_table(m -> capacity);
+    m -> num_segments = header.num_segments;
+    m -> free_head = header.free_head;
+
+    Snapshot_slot *slots = (Snapshot_slot *) (image + sizeof(header));
+    uint64_t storage = sizeof(header) 
+                       + (uint64_t) header.num_segments * sizeof(*slots);
+    if (!free_list_valid(slots, header.num_segments, header.free_head)) {
+        fprintf(stderr, "Bad snapshot %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < header.num_segments; i++) {
+        m -> segments[i].words = NULL;
+        m -> segments[i].length = 0;
+        m -> segments[i].next_free = slots[i].next_free;
+        if (slots[i].offset == 0) {
+            continue;
+        }
+        Array segment = (Array) (image + slots[i].offset);
+        if (slots[i].offset < storage 
+            || slots[i].offset % snapshot_align != 0
+            || slots[i].offset > size - sizeof(*segment)
+            || (size - slots[i].offset - sizeof(*segment)) 
+               / sizeof(uint32_t) < (size_t) segment -> length) {
+            fprintf(stderr, "Bad snapshot %s\n", filename);
+            exit(EXIT_FAILURE);
+        }
+        /* shares are counted again below */
+        segment -> refs = 0;
+        segment -> size_class = mapped_class;
+        put_segment(m, i, segment);
+    }
+    for (uint32_t i = 0; i < header.num_segments; i++) {
+        Array segment = segment_storage(m, i);
+        if (segment != NULL) {
+            segment -> refs++;
+        }
+    }
+    if (segment_storage(m, 0) == NULL) {
+        fprintf(stderr, "Bad snapshot %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(m -> registers, header.registers, sizeof(m -> registers));
+    m -> pc = header.pc;
+    decode_segment_0(m, false);
+}
 
-/* UM waits for input on I/O device, reg_c is loaded with input which 
-must be a value from 0 to 255, if the end of input is signaled, reg_c is 
-loaded with a 32­bit word in which every bit is 1 */
-static inline void input (uint32_t* registers, 
-                             uint32_t reg_c); 
+/* returns true if the unmapped list from head runs through unmapped slots
+   of the num_slots only, once each, to its end. Any other link would hand
+   out a slot twice or one outside the table */
+static bool free_list_valid(const Snapshot_slot *slots, uint32_t num_slots,
+                            uint32_t head)
+{
+    uint32_t unmapped = 0;
 
-/* segment [reg_b] is duplicated and duplicate replaces segment[0], 
-program counter is set to point to segment[0][reg_c] */
-static inline void load_program (UM_Mem m, uint32_t* registers, 
-                        uint32_t reg_b, uint32_t reg_c, int *pc);
+    for (uint32_t i = 0; i < num_slots; i++) {
+        if (slots[i].offset == 0) {
+            unmapped++;
+        }
+    }
+    for (uint32_t i = head; i != no_segment; i = slots[i].next_free) {
+        if (i >= num_slots || slots[i].offset != 0 || unmapped-- == 0) {
+            return false;
+        }
+    }
+    return true;
+}
 
-/* value is loaded into register a  */
-static inline void load_value (uint32_t* registers, 
-                             uint32_t reg_c, uint32_t value);
+/* segment 0 is replaced by segment seg_id, sharing its storage until one of
+   them is written, so jumping between code segments costs no copy (in an
+   arena build segment 0 stays put and the words are copied). A large one
+   is predecoded by the helper under --compile-thread */
+static inline void load_segment(UM_Mem m, int seg_id) 
+{
+    Array segment = segment_storage(m, seg_id);
+    Array seg_0 = segment_storage(m, 0);       
 
+    /* already running this very storage */
+    if (segment == seg_0) {
+        return;
+    }
+    if (m -> compiling != NULL) {
+        finish_compile(m);
+    }
+    segment -> refs++;
+#ifndef UM_ARENA
+    Array_release(m -> pool, &seg_0);
+#endif
+    put_segment(m, 0, segment);
+    decode_segment_0(m, true);
+    m -> aot = NULL;
+    if (m -> jit != NULL) {
+        Jit_reset(m -> jit, segment -> elems, Array_length(segment));
+    }
+}
 
-int main (int argc, char const *argv[])
+/* gives segment seg_id storage of its own before it is written */
+static inline Array unshare_segment(UM_Mem m, int seg_id)
 {
-    /* .um file must be second command line argument */
-    if (argc != 2) {
-        fprintf(stderr, "Incorrect input\n");
-        return EXIT_FAILURE;
+    Array shared = segment_storage(m, seg_id);
+    Array copy = Array_copy(m -> pool, shared, Array_length(shared));
+
+    Array_release(m -> pool, &shared);
+    put_segment(m, seg_id, copy);
+    /* the words are unchanged, but translated code must read the copy */
+    if (seg_id == 0 && m -> jit != NULL) {
+        Jit_reset(m -> jit, copy -> elems, Array_length(copy));
     }
-    /* initialize UM memory */
-    UM_Mem memory = new_memory();
-
-    /* load .um program */
-    load_instruction(memory, argv[1]);
-    execute(memory);
-    free_memory(memory);
-    return 0;
+    return copy;
 }
 
+/* stores value at segment[seg_id][offset], keeping the predecoded and 
+   translated copies of segment 0 in step. Returns true if translated code 
+   was dropped */
+static inline bool store_word(UM_Mem m, uint32_t seg_id, uint32_t offset, 
+                              uint32_t value)
+{
+    Array segment = segment_storage(m, seg_id);
+    bool dropped = false;
 
-/* returns a new UM_Mem with an empty memory sequence capable of holding 
-   UArray segments, and an empty mem_tracker stack */
-static inline UM_Mem new_memory()
+    if (segment -> refs > 1) {
+        segment = unshare_segment(m, seg_id);
+        dropped = (seg_id == 0 && m -> jit != NULL);
+    }
+    *Array_at(segment, offset) = value;
+    if (seg_id != 0) {
+        return false;
+    }
+    if (m -> compiling != NULL) {
+        note_store(m -> compiling, offset);
+        return dropped;
+    }
+    /* the word can start a superinstruction or end the one before it */
+    m -> decoded[offset] = decode_word(value);
+    fuse_at(m, offset);
+    if (offset > 0) {
+        fuse_at(m, offset - 1);
+    }
+    if (m -> jit != NULL && Jit_invalidate(m -> jit, offset)) {
+        dropped = true;
+    }
+    return dropped;
+}
+
+/* returns the fields of a 32-bit instruction word */
+static inline Decoded decode_word(uint32_t word)
 {
-    UM_Mem mem = malloc (sizeof(*mem)); 
+    Decoded d;
+    d.opcode = Bitpack_getu(word, op_width, op_lsb);
+    if (d.opcode == LOADV) {
+        d.reg_a = Bitpack_getu(word, reg_width, reg_a_lsb2);
+        d.reg_b = 0;
+        d.reg_c = 0;
+        d.value = Bitpack_getu(word, value_width, value_lsb);
+    } else {
+        d.reg_a = Bitpack_getu(word, reg_width, reg_a_lsb1);
+        d.reg_b = Bitpack_getu(word, reg_width, reg_b_lsb);
+        d.reg_c = Bitpack_getu(word, reg_width, reg_c_lsb);
+        d.value = 0;
+    }
+    return d;
+}
 
-    mem -> memory = Seq_new(50);
-    mem -> mem_tracker = Stack_new (); 
+/* rebuilds the predecoded array after segment 0 is loaded or replaced. 
+   With --code-cache a large segment 0 is looked up by its words and, on 
+   a miss, saved once predecoded. In the background (a LOADP under 
+   --compile-thread) the helper does the predecoding and the saving */
+static inline void decode_segment_0(UM_Mem m, bool background)
+{
+    Array seg_0 = segment_storage(m, 0);
+    uint32_t length = Array_length(seg_0);
+    /* one spare record so an empty segment 0 still gets a valid block */
+    size_t bytes = ((size_t) length + 1) * sizeof(*(m -> decoded));
+    const char *cache_dir = length >= cache_threshold ? m -> cache_dir 
+                                                      : NULL;
+    Cache_key key = { { 0, 0 }, 0 };
+
+    if (cache_dir != NULL) {
+        key = Cache_key_of(seg_0 -> elems, length);
+        Decoded *cached = Cache_map(cache_dir, key, decoded_format, bytes);
+        if (cached != NULL && !decoded_valid(cached, length)) {
+            Cache_unmap(cached, bytes);
+            cached = NULL;
+        }
+        if (cached != NULL) {
+            drop_decoded(m);
+            m -> decoded = cached;
+            m -> decoded_mapped = bytes;
+            return;
+        }
+    }
+    if (background && m -> compile_thread && length >= compile_threshold) {
+        start_compile(m, cache_dir, key);
+        return;
+    }
+    if (m -> decoded_mapped > 0) {
+        drop_decoded(m);
+    }
+    m -> decoded = realloc(m -> decoded, bytes);
+    assert(m -> decoded != NULL);
+    if (m -> pool -> huge_pages) {
+        advise_huge_pages(m -> decoded, bytes);
+    }
+    decode_words(seg_0 -> elems, length, m -> decoded);
+    if (cache_dir != NULL) {
+        Cache_save(cache_dir, key, decoded_format, m -> decoded, bytes);
+    }
+}
 
-    return mem; 
+/* frees or unmaps the predecoded array */
+static void drop_decoded(UM_Mem m)
+{
+    if (m -> decoded_mapped > 0) {
+        Cache_unmap(m -> decoded, m -> decoded_mapped);
+    } else {
+        free(m -> decoded);
+    }
+    m -> decoded = NULL;
+    m -> decoded_mapped = 0;
 }
 
-/* frees all associated memory in the UM_mem */
-static inline void free_memory(UM_Mem m)
+/* returns true if every record has an opcode with a handler and register 
+   fields that name a register, and the last is not a superinstruction. 
+   The engines trust all three, and a cache file is only as good as 
+   whoever wrote it; a file that fails is a miss */
+static bool decoded_valid(const Decoded *decoded, uint32_t length)
 {
-    Array temp = NULL;
-    int length = Seq_length(m -> memory);
-    /* free every element of the sequence until it is empty */
-    for (int i = 0; i < length; i++){
-            temp = Seq_get (m -> memory, i);
-            Array_free (&temp);
+    for (uint32_t i = 0; i < length; i++) {
+        Decoded d = decoded[i];
+        if (d.opcode >= NUM_HANDLERS || d.reg_a >= 8 || d.reg_b >= 8 
+            || d.reg_c >= 8) {
+            return false;
+        }
     }
+    return length == 0 
+           || unfuse(decoded[length - 1].opcode) == decoded[length - 1].opcode;
+}
 
-    Seq_free (&(m -> memory));
-    Stack_free (&(m -> mem_tracker));
-    free(m);
+/* predecodes length words into decoded, superinstructions and all; the 
+   last word is never fused */
+static void decode_words(const uint32_t *words, uint32_t length, 
+                         Decoded *decoded)
+{
+    for (uint32_t i = 0; i < length; i++) {
+        decoded[i] = decode_word(words[i]);
+    }
+    for (uint32_t i = 0; i + 1 < length; i++) {
+        decoded[i].opcode = fuse(words[i], words[i + 1]);
+    }
 }
 
-/* creates a segment in UM_mem capable of holding num_words, 32-bit words and 
-   returns seg_id */
-static inline int map_seg(UM_Mem m, int num_words)
-{
-    uint64_t index;
-    /* creates new UArray to hold num_words and size of a uint32_t */
-    Array segment = Array_new(num_words);
-
-    /* checks if stack of unmapped segments is empty */     
-    if (Stack_empty (m -> mem_tracker) == 1){
-            /* add segment to sequence */
-            Seq_addhi (m -> memory, segment);
-            return (Seq_length (m -> memory) - 1);
-     } else {
-            index = Stack_pop (m -> mem_tracker);
-            Array old = Seq_get(m -> memory, index);
-            Array_free(&old);
-            Seq_put (m -> memory, index, segment);
-            return (int)index;
+/* hands the predecoding of the new segment 0 to a helper thread, which 
+   writes a fresh array; m->decoded is left stale until finish_compile().
+   A thread per load is cheap next to predecoding compile_threshold words,
+   and programs load another segment a handful of times */
+static void start_compile(UM_Mem m, const char *cache_dir, Cache_key key)
+{
+    Compile *job = malloc(sizeof(*job));
+    size_t bytes = ((size_t) segment_length(m, 0) + 1) * sizeof(Decoded);
+
+    assert(job != NULL);
+    job -> code = segment_storage(m, 0);
+    job -> code -> refs++;
+    job -> decoded = malloc(bytes);
+    assert(job -> decoded != NULL);
+    if (m -> pool -> huge_pages) {
+        advise_huge_pages(job -> decoded, bytes);
     }
-} 
+    job -> done = 0;
+    job -> stores = NULL;
+    job -> num_stores = 0;
+    job -> stores_capacity = 0;
+    job -> cache_dir = cache_dir;
+    job -> key = key;
+    if (pthread_create(&(job -> thread), NULL, compile_main, job) != 0) {
+        Array_release(m -> pool, &(job -> code));
+        free(job -> decoded);
+        free(job);
+        decode_segment_0(m, false);
+        return;
+    }
+    m -> compiling = job;
+}
 
-/* pushes segment id onto mem_tracker to be reused */
-static inline void unmap_seg(UM_Mem m, int seg_id)
+/* the helper thread of --compile-thread, job is its Compile */
+static void *compile_main(void *job)
 {
-    assert (seg_id < Seq_length(m -> memory));
+    Compile *compile = job;
 
-    Array segment = Seq_get (m -> memory, seg_id);
-    uint64_t seg_index = seg_id; 
+    uint32_t length = Array_length(compile -> code);
 
-    if (segment != NULL){   
-            Stack_push (m -> mem_tracker, seg_index);
+    decode_words(compile -> code -> elems, length, compile -> decoded);
+    if (compile -> cache_dir != NULL) {
+        Cache_save(compile -> cache_dir, compile -> key, decoded_format, 
+                   compile -> decoded, 
+                   ((size_t) length + 1) * sizeof(Decoded));
     }
-} 
+    __atomic_store_n(&(compile -> done), 1, __ATOMIC_RELEASE);
+    return NULL;
+}
 
-/* returns address of a particular offset in a particular segment in memory */
-static inline uint32_t* mem_address(UM_Mem m, int seg_id, int offset)
-{       
-    Array segment = Seq_get (m -> memory, seg_id);
-    return Array_at(segment, offset);
-} 
+/* notes a store into segment 0 at offset while the helper works */
+static void note_store(Compile *job, uint32_t offset)
+{
+    if (job -> num_stores == job -> stores_capacity) {
+        job -> stores_capacity = job -> stores_capacity == 0 
+                                 ? 64 : 2 * job -> stores_capacity;
+        job -> stores = realloc(job -> stores, job -> stores_capacity 
+                                               * sizeof(uint32_t));
+        assert(job -> stores != NULL);
+    }
+    job -> stores[job -> num_stores++] = offset;
+}
 
-/* loads 32-bit word into segment 0 */
-static inline void load_instruction(UM_Mem m, const char* filename) 
-{ 
-    FILE *fp = fopen (filename, "r");
-    assert (fp != NULL);
-
-    uint32_t codeword = 0;
-    uint32_t *pointer;
-    int seg_index = 0;
-    int counter = 0;
-        
-    struct stat file_info; 
-    assert (stat(filename, &file_info) == 0);
-    int num_instructions = file_info.st_size / 4; 
-
-    Array segment_0 = Array_new(num_instructions);
-    int c = 0;
-    while (counter < num_instructions) {
-        for (int i = 3; i >= 0; i--) {
-            c = getc(fp);
-            if (c == EOF) { 
-                break;
-            }
-            codeword = Bitpack_newu(codeword, 8, 8 * i, (uint64_t) c);
+/* waits for the helper and puts its predecoded segment 0 in place, then 
+   predecodes again the words stored to since it started. Segment 0 is 
+   still the one it was given, another LOADP finishes the helper first */
+static void finish_compile(UM_Mem m)
+{
+    Compile *job = m -> compiling;
+
+    pthread_join(job -> thread, NULL);
+    m -> compiling = NULL;
+    drop_decoded(m);
+    m -> decoded = job -> decoded;
+    for (uint32_t i = 0; i < job -> num_stores; i++) {
+        uint32_t offset = job -> stores[i];
+        m -> decoded[offset] = decode_word(m -> segments[0].words[offset]);
+        fuse_at(m, offset);
+        if (offset > 0) {
+            fuse_at(m, offset - 1);
         }
-        pointer = Array_at (segment_0, seg_index);
-        *pointer = codeword;
-        counter++;
-        seg_index++;
     }
-    Seq_addhi (m -> memory, segment_0);
-    fclose(fp);
+    Array_release(m -> pool, &(job -> code));
+    free(job -> stores);
+    free(job);
 }
 
-/* mem segment at the seg_id is duplicated, and duplicate replaces segment 0*/
-static inline void load_segment(UM_Mem m, int seg_id) 
+/* returns the superinstruction for the pair of words, or the opcode of 
+   first if they are not one */
+static inline uint8_t fuse(uint32_t first, uint32_t second)
+{
+    uint8_t opcode = Bitpack_getu(first, op_width, op_lsb);
+    uint8_t next = Bitpack_getu(second, op_width, op_lsb);
+
+#ifndef UM_FUSION_PROFILE
+    if (opcode == LOADV) {
+        switch (next) {
+            case SLOAD:  return LOADV_SLOAD;
+            case SSTORE: return LOADV_SSTORE;
+            case ADD:    return LOADV_ADD;
+            case LOADV:  return LOADV_LOADV;
+            case LOADP:  return LOADV_LOADP;
+        }
+    } else if (opcode == NAND && next == NAND) {
+        return NAND_NAND;
+    }
+#else
+    (void) next;
+#endif
+    return opcode;
+}
+
+/* returns the opcode of the first word of a superinstruction, or opcode 
+   itself if it is not one. Every pair but NAND_NAND starts with a LOADV */
+static inline uint8_t unfuse(uint8_t opcode)
 {
-    Array to_copy = Seq_get(m -> memory, seg_id);
-    Array segment = Array_copy(to_copy, Array_length(to_copy));
+    if (opcode == NAND_NAND) {
+        return NAND;
+    }
+    return opcode >= LOADV_SLOAD ? LOADV : opcode;
+}
 
-    Array seg_0 = Seq_get(m -> memory, 0);       
-    Array_free(&seg_0);
+/* sets the handler of segment 0 word offset from it and the word after, 
+   the last word is never fused */
+static inline void fuse_at(UM_Mem m, uint32_t offset)
+{
+    uint32_t *words = m -> segments[0].words;
 
-    Seq_put(m->memory, 0, segment);
+    if (offset + 1 < m -> segments[0].length) {
+        m -> decoded[offset].opcode = fuse(words[offset], 
+                                           words[offset + 1]);
+    }
 }
 
 /* returns the length of the segment associated with seg_id */
-static inline int segment_length(UM_Mem m, int seg_id)
+static inline uint32_t segment_length(UM_Mem m, int seg_id)
 {
-    Array segment = Seq_get (m -> memory, seg_id);
-    int length = Array_length(segment);
-    return length;
+#ifdef UM_ARENA
+    return Array_length(segment_storage(m, seg_id));
+#else
+    return m -> segments[seg_id].length;
+#endif
 } 
 
 /* prints out the sequence memory, and corresponding segments */
@@ -343,14 +2499,18 @@ static inline void print_mem_map(UM_Mem m)
 {
     Array segment;
     uint32_t *word;
-    printf("Seq_length is %d\n", Seq_length(m->memory));
-    for (int i= 0; i < Seq_length(m -> memory); i++) {
-            segment = Seq_get(m -> memory, i);
-            printf("Segment_%d[%d] : | ", i, segment_length(m, i));
+    printf("num_segments is %"PRIu32"\n", m -> num_segments);
+    for (int i= 0; i < (int) m -> num_segments; i++) {
+            segment = segment_storage(m, i);
+            if (segment == NULL) {
+                    printf("Segment_%d unmapped\n", i);
+                    continue;
+            }
+            printf("Segment_%d[%"PRIu32"] : | ", i, segment_length(m, i));
                 
-            for (int j = 0; j < Array_length(segment); j++) {
+            for (uint32_t j = 0; j < Array_length(segment); j++) {
                     word = Array_at(segment, j);
-                    printf("{%d} %"PRIu32" |", j, *word);
+                    printf("{%"PRIu32"} %"PRIu32" |", j, *word);
             }        
             printf("\n");
     }
@@ -358,22 +2518,543 @@ static inline void print_mem_map(UM_Mem m)
 
 static inline void execute (UM_Mem m)
 {
-    uint32_t registers [8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    uint32_t registers [8];
     uint32_t command;
     bool halt_called = false;
-    int pc = 0; 
+    int pc = m -> pc; 
+
+    memcpy(registers, m -> registers, sizeof(registers));
+    m -> running_registers = registers;
+#ifdef UM_PROFILE
+    Profile profile;
+    memset(&profile, 0, sizeof(profile));
+    clock_gettime(CLOCK_MONOTONIC, &profile.start);
+#endif
     while (!last_instruction(&pc, m)) {
         if (halt_called == true) {
             break;
         }
+#ifdef UM_PROFILE
+        uint32_t at = pc;
+#endif
         command = get_instruction(m, &pc);
         handle_instruction(m, command, registers, &pc, &halt_called);
+#ifdef UM_PROFILE
+        m -> instructions++;
+        if (m -> profile) {
+            profile_count(&profile, command, at, pc, registers);
+        }
+#endif
+    }
+    m -> running_registers = NULL;
+#ifdef UM_PROFILE
+    if (m -> profile) {
+        profile_report(&profile);
+    }
+#endif
+}
+
+#ifdef UM_PROFILE
+/* counts the instruction command at pc, which left the machine at next_pc 
+   with the given registers */
+static void profile_count (Profile *p, uint32_t command, uint32_t pc,
+                           uint32_t next_pc, const uint32_t *registers)
+{
+    uint32_t opcode = Bitpack_getu(command, op_width, op_lsb);
+    uint32_t highest = pc > next_pc ? pc : next_pc;
+
+    if (highest >= p -> length) {
+        uint32_t length = p -> length == 0 ? 1024 : p -> length;
+        while (length <= highest) {
+            length *= 2;
+        }
+        p -> pcs = realloc(p -> pcs, length * sizeof(uint64_t));
+        p -> loadp_targets = realloc(p -> loadp_targets, 
+                                     length * sizeof(uint64_t));
+        assert(p -> pcs != NULL && p -> loadp_targets != NULL);
+        memset(p -> pcs + p -> length, 0, 
+               (length - p -> length) * sizeof(uint64_t));
+        memset(p -> loadp_targets + p -> length, 0, 
+               (length - p -> length) * sizeof(uint64_t));
+        p -> length = length;
+    }
+    p -> opcodes[opcode]++;
+    p -> pcs[pc]++;
+    if (opcode == LOADP) {
+        p -> loadp_targets[next_pc]++;
+        if (registers[Bitpack_getu(command, reg_width, reg_b_lsb)] != 0) {
+            p -> segment_loads++;
+        }
+    }
+}
+
+/* index of a count, for sorting the busiest first */
+typedef struct Profile_entry {
+    uint64_t count;
+    uint32_t index;
+} Profile_entry;
+
+static int compare_entries (const void *a, const void *b)
+{
+    uint64_t x = ((const Profile_entry *) a) -> count;
+    uint64_t y = ((const Profile_entry *) b) -> count;
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+/* prints the nonzero counts, busiest first, at most limit of them */
+static void print_counts (const char *title, const uint64_t *counts, 
+                          uint32_t length, uint32_t limit, uint64_t total)
+{
+    Profile_entry *entries = malloc((length + 1) * sizeof(*entries));
+    uint32_t used = 0;
+
+    assert(entries != NULL);
+    for (uint32_t i = 0; i < length; i++) {
+        if (counts[i] > 0) {
+            entries[used].count = counts[i];
+            entries[used].index = i;
+            used++;
+        }
+    }
+    qsort(entries, used, sizeof(*entries), compare_entries);
+    fprintf(stderr, "%s\n", title);
+    for (uint32_t i = 0; i < used && i < limit; i++) {
+        fprintf(stderr, "  %10" PRIu32 " %15" PRIu64 " %6.2f%%\n", 
+                entries[i].index, entries[i].count, 
+                100.0 * entries[i].count / (total == 0 ? 1 : total));
+    }
+    free(entries);
+}
+
+/* prints the counts sorted, with the instruction total and MIPS, to 
+   stderr and frees them */
+static void profile_report (Profile *p)
+{
+    static const char *names[16] = {
+        "CMOV", "SLOAD", "SSTORE", "ADD", "MUL", "DIV", "NAND", "HALT", 
+        "MAP", "UNMAP", "OUTPUT", "INPUT", "LOADP", "LOADV", "14", "15"
+    };
+    struct timespec end;
+    uint64_t total = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - p -> start.tv_sec) 
+                     + (end.tv_nsec - p -> start.tv_nsec) / 1e9;
+    for (int i = 0; i < 16; i++) {
+        total += p -> opcodes[i];
+    }
+    fprintf(stderr, "%" PRIu64 " instructions in %.3f s, %.1f MIPS\n", 
+            total, seconds, total / (seconds > 0 ? seconds : 1) / 1e6);
+
+    Profile_entry opcodes[16];
+    for (int i = 0; i < 16; i++) {
+        opcodes[i].count = p -> opcodes[i];
+        opcodes[i].index = i;
+    }
+    qsort(opcodes, 16, sizeof(*opcodes), compare_entries);
+    fprintf(stderr, "opcodes\n");
+    for (int i = 0; i < 16 && opcodes[i].count > 0; i++) {
+        fprintf(stderr, "  %10s %15" PRIu64 " %6.2f%%\n", 
+                names[opcodes[i].index], opcodes[i].count, 
+                100.0 * opcodes[i].count / total);
+    }
+    print_counts("hottest pcs", p -> pcs, p -> length, 20, total);
+    fprintf(stderr, "%" PRIu64 " LOADPs, %" PRIu64 " of another segment\n",
+            p -> opcodes[LOADP], p -> segment_loads);
+    print_counts("hottest LOADP targets", p -> loadp_targets, p -> length,
+                 20, p -> opcodes[LOADP]);
+    free(p -> pcs);
+    free(p -> loadp_targets);
+}
+#endif
+
+#ifdef UM_FUSION_PROFILE
+/* pairs and triples of opcodes executed back to back, printed at exit */
+static uint64_t pair_counts[16][16];
+static uint64_t triple_counts[16][16][16];
+
+static void print_fusion_profile(void)
+{
+    uint64_t total = 0;
+    for (int a = 0; a < 16; a++) {
+        for (int b = 0; b < 16; b++) {
+            total += pair_counts[a][b];
+        }
+    }
+    fprintf(stderr, "%" PRIu64 " instructions\n", total);
+    for (int a = 0; a < 16; a++) {
+        for (int b = 0; b < 16; b++) {
+            if (pair_counts[a][b] > 0) {
+                fprintf(stderr, "pair %2d %2d %" PRIu64 "\n", a, b, 
+                        pair_counts[a][b]);
+            }
+            for (int c = 0; c < 16; c++) {
+                if (triple_counts[a][b][c] > 0) {
+                    fprintf(stderr, "triple %2d %2d %2d %" PRIu64 "\n", 
+                            a, b, c, triple_counts[a][b][c]);
+                }
+            }
+        }
+    }
+}
+
+#define PROFILE_OPCODE(opcode)                                  \
+    do {                                                        \
+        pair_counts[last_op][opcode]++;                         \
+        triple_counts[before_last_op][last_op][opcode]++;       \
+        before_last_op = last_op;                               \
+        last_op = opcode;                                       \
+    } while (0)
+#else
+#define PROFILE_OPCODE(opcode) ((void) 0)
+#endif
+
+/* Threaded engine: the dispatch table is indexed by opcode and every 
+   handler ends in its own copy of DISPATCH(), so each handler gets its own 
+   indirect jump (and its own branch predictor entry) instead of sharing the
+   single jump of the switch in handle_instruction(). Instructions come from
+   the predecoded copy of segment 0, which segmented_store() keeps in step 
+   with the words. Labels as values are a GNU extension, so -pedantic is 
+   silenced for this function only */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+static void execute_threaded (UM_Mem m)
+{
+    static void *dispatch[NUM_HANDLERS] = {
+        &&op_cmov, &&op_sload, &&op_sstore, &&op_add, 
+        &&op_mul, &&op_div, &&op_nand, &&op_halt, 
+        &&op_map, &&op_unmap, &&op_output, &&op_input, 
+        &&op_loadp, &&op_loadv, &&op_invalid, &&op_invalid,
+        &&op_loadv_sload, &&op_loadv_sstore, &&op_loadv_add, 
+        &&op_loadv_loadv, &&op_loadv_loadp, &&op_nand_nand
+    };
+    uint32_t registers [8];
+    Decoded *code = m -> decoded;
+    uint32_t length = segment_length(m, 0);
+    uint32_t pc = m -> pc;
+    Decoded *d;
+    uint64_t retired = 0;
+
+    memcpy(registers, m -> registers, sizeof(registers));
+    m -> running_registers = registers;
+#ifdef UM_FUSION_PROFILE
+    uint8_t last_op = 15, before_last_op = 15;
+    atexit(print_fusion_profile);
+#endif
+
+#define REG_A registers[d -> reg_a]
+#define REG_B registers[d -> reg_b]
+#define REG_C registers[d -> reg_c]
+#define DISPATCH()                                      \
+    do {                                                \
+        if (pc >= length) {                             \
+            goto done;                                  \
+        }                                               \
+        d = &code[pc++];                                \
+        RETIRE();                                       \
+        PROFILE_OPCODE(d -> opcode);                    \
+        goto *dispatch[d -> opcode];                    \
+    } while (0)
+/* for --perf-counters, only in a -DUM_PROFILE build: the counter cost 2-3%
+   on sandmark. The second half of a superinstruction retires one more */
+#ifdef UM_PROFILE
+#define RETIRE() (retired++)
+#else
+#define RETIRE() ((void) retired)
+#endif
+
+    DISPATCH();
+
+op_cmov:
+    if (REG_C != 0) {
+        REG_A = REG_B;
+    }
+    DISPATCH();
+op_sload:
+    REG_A = *mem_address(m, REG_B, REG_C);
+    DISPATCH();
+op_sstore:
+    segmented_store(m, registers, d -> reg_a, d -> reg_b, d -> reg_c);
+    DISPATCH();
+op_add:
+    REG_A = REG_B + REG_C;
+    DISPATCH();
+op_mul:
+    REG_A = REG_B * REG_C;
+    DISPATCH();
+op_div:
+    REG_A = REG_B / REG_C;
+    DISPATCH();
+op_nand:
+    REG_A = ~(REG_B & REG_C);
+    DISPATCH();
+op_halt:
+done:
+    m -> running_registers = NULL;
+    m -> instructions += retired;
+    return;
+op_map:
+    REG_B = map_seg(m, REG_C);
+    DISPATCH();
+op_unmap:
+    unmap_seg(m, REG_C);
+    DISPATCH();
+op_output:
+    output(m, registers, d -> reg_c);
+    DISPATCH();
+op_input:
+    before_input(m, registers, pc - 1);
+    input(m, registers, d -> reg_c);
+    DISPATCH();
+op_loadp:
+    if (m -> trace != NULL) {
+        trace_loadp(m, registers, pc - 1, REG_B, REG_C);
+    }
+    if (REG_B != 0 && m -> checkpoint_file != NULL) {
+        before_load(m, registers, pc - 1);
+    }
+    /* read the target first, loading a segment moves the decoded array */
+    pc = REG_C;
+    if (REG_B != 0) {
+        load_segment(m, REG_B);
+        if (m -> compiling != NULL) {
+            int cold_pc = pc;
+            bool halt_called = false;
+            run_cold(m, registers, &cold_pc, &halt_called);
+            if (halt_called) {
+                goto done;
+            }
+            pc = cold_pc;
+        }
+        code = m -> decoded;
+        length = segment_length(m, 0);
+    }
+    DISPATCH();
+op_loadv:
+    REG_A = d -> value;
+    DISPATCH();
+
+    /* superinstructions: the first half, then d moves on to the second */
+op_loadv_sload:
+    REG_A = d -> value;
+    d = &code[pc++];
+    RETIRE();
+    REG_A = *mem_address(m, REG_B, REG_C);
+    DISPATCH();
+op_loadv_sstore:
+    REG_A = d -> value;
+    d = &code[pc++];
+    RETIRE();
+    segmented_store(m, registers, d -> reg_a, d -> reg_b, d -> reg_c);
+    DISPATCH();
+op_loadv_add:
+    REG_A = d -> value;
+    d = &code[pc++];
+    RETIRE();
+    REG_A = REG_B + REG_C;
+    DISPATCH();
+op_loadv_loadv:
+    REG_A = d -> value;
+    d = &code[pc++];
+    RETIRE();
+    REG_A = d -> value;
+    DISPATCH();
+op_loadv_loadp:
+    REG_A = d -> value;
+    d = &code[pc++];
+    RETIRE();
+    goto op_loadp;
+op_nand_nand:
+    REG_A = ~(REG_B & REG_C);
+    d = &code[pc++];
+    RETIRE();
+    REG_A = ~(REG_B & REG_C);
+    DISPATCH();
+op_invalid:
+    fail(m);
+
+#undef RETIRE
+#undef DISPATCH
+#undef REG_C
+#undef REG_B
+#undef REG_A
+}
+#pragma GCC diagnostic pop
+
+/* JIT engine: translated blocks run until they reach an instruction the 
+   JIT leaves to the interpreter (HALT, OUTPUT, INPUT, a LOADP of another 
+   segment), which interpret_exit() then executes */
+static void execute_jit (UM_Mem m)
+{
+    uint32_t registers [8];
+    Jit_runtime runtime = { m, (void **) &(m -> segments), 
+                            (int) offsetof(struct Array, refs) 
+                            - (int) offsetof(struct Array, elems), 
+                            jit_sstore, jit_map, jit_unmap, 
+                            m -> pool -> huge_pages };
+    Array seg_0 = segment_storage(m, 0);
+    bool halt_called = false;
+    int pc = m -> pc;
+
+    memcpy(registers, m -> registers, sizeof(registers));
+    m -> running_registers = registers;
+    m -> jit = Jit_new(runtime);
+    if (m -> jit == NULL) {
+        execute_threaded(m);
+        return;
+    }
+    Jit_reset(m -> jit, seg_0 -> elems, Array_length(seg_0));
+
+    while (!last_instruction(&pc, m) && !halt_called) {
+        /* a block returning its own pc says nothing: it may be a LOADP
+           of another segment, or a chained block dropping the one we 
+           entered. So what blocks leave behind is told from the word */
+        uint32_t word = *mem_address(m, 0, pc);
+        uint32_t opcode = word >> 28;
+        if (opcode == HALT || opcode == OUTPUT || opcode == INPUT 
+            || opcode > LOADV 
+            || (opcode == LOADP 
+                && registers[Bitpack_getu(word, reg_width, reg_b_lsb)] != 0)) {
+            interpret_exit(m, registers, &pc, &halt_called);
+            continue;
+        }
+        Jit_block *block = Jit_lookup(m -> jit, pc);
+        assert(block != NULL);
+        pc = block(registers);
+    }
+    m -> running_registers = NULL;
+    Jit_free(&(m -> jit));
+}
+
+/* Runs the blocks um_aot translated segment 0 into. Where no block starts
+   is either an instruction blocks leave to interpret_exit(), or code the 
+   translator never saw or that was stored to since, which is run by 
+   execute_threaded() from then on. So is everything after a LOADP of 
+   another segment, which sets m -> aot to NULL */
+static void execute_aot (UM_Mem m)
+{
+    uint32_t registers [8];
+    Aot_runtime runtime = { m, (Aot_segment **) &(m -> segments), 
+                            (int) offsetof(struct Array, refs) 
+                            - (int) offsetof(struct Array, elems), 
+                            m -> aot -> program -> covered, aot_sstore, 
+                            jit_map, jit_unmap };
+    bool halt_called = false;
+    int pc = m -> pc;
+
+    memcpy(registers, m -> registers, sizeof(registers));
+    m -> running_registers = registers;
+    while (m -> aot != NULL && (uint32_t) pc < m -> aot -> program -> length
+           && !halt_called) {
+        Aot_block *block = m -> aot -> blocks[pc];
+        if (block != NULL) {
+            m -> aot -> running = pc;
+            int next = block(&runtime, registers);
+            if (next != pc) {
+                pc = next;
+                continue;
+            }
+        }
+        /* blocks store into segment 0 without predecoding the word */
+        m -> decoded[pc] = decode_word(*mem_address(m, 0, pc));
+        uint8_t opcode = m -> decoded[pc].opcode;
+        if (opcode != HALT && opcode != OUTPUT && opcode != INPUT 
+            && opcode != LOADP) {
+            break;
+        }
+        interpret_exit(m, registers, &pc, &halt_called);
+    }
+    m -> running_registers = NULL;
+    if (!halt_called) {
+        /* blocks left the predecoded copy stale wherever they stored; 
+           after a LOADP it is of the new segment 0 and current */
+        if (m -> aot != NULL) {
+            m -> aot = NULL;
+            decode_segment_0(m, false);
+        }
+        memcpy(m -> registers, registers, sizeof(registers));
+        m -> pc = pc;
+        execute_threaded(m);
+    }
+}
+
+/* executes the instruction at *pc, one of those the JIT leaves to the 
+   interpreter */
+static void interpret_exit (UM_Mem m, uint32_t *registers, int *pc, 
+                            bool *halt_flag)
+{
+    Decoded d = m -> decoded[(*pc)++];
+
+    /* as in Um_run(), the record may start a superinstruction */
+    d.opcode = unfuse(d.opcode);
+    if (!run_decoded(m, d, registers, pc, halt_flag)) {
+        fail(m);
+    }
+}
+
+/* runs segment 0 from its words until the helper of 
+   --compile-thread has predecoded it, or it halts or runs off the end. 
+   Another segment loaded or the fork of --serve --warm finish the 
+   helper's work early, which also ends the wait */
+static void run_cold (UM_Mem m, uint32_t *registers, int *pc, 
+                      bool *halt_flag)
+{
+    while (m -> compiling != NULL && !*halt_flag 
+           && (uint32_t) *pc < segment_length(m, 0)) {
+        if (__atomic_load_n(&(m -> compiling -> done), __ATOMIC_ACQUIRE)) {
+            finish_compile(m);
+            break;
+        }
+        Decoded d = decode_word(*mem_address(m, 0, (*pc)++));
+#ifdef UM_PROFILE
+        m -> instructions++;
+#endif
+        if (!run_decoded(m, d, registers, pc, halt_flag)) {
+            fail(m);
+        }
+    }
+}
+
+static uint32_t jit_sstore (void *memory, uint32_t seg_id, uint32_t offset,
+                            uint32_t value)
+{
+    return store_word(memory, seg_id, offset, value);
+}
+
+static uint32_t aot_sstore (void *memory, uint32_t seg_id, uint32_t offset,
+                            uint32_t value)
+{
+    UM_Mem m = memory;
+    Aot *aot = m -> aot;
+
+    store_word(m, seg_id, offset, value);
+    if (seg_id != 0 || aot == NULL 
+        || !((aot -> program -> covered[offset / 32] >> (offset % 32)) & 1)) {
+        return 0;
     }
+    /* blocks do not overlap, the word is in the last one starting at or 
+       before it */
+    uint32_t start = offset;
+    while (aot -> program -> blocks[start] == NULL) {
+        start--;
+    }
+    aot -> blocks[start] = NULL;
+    return start == aot -> running;
+}
+
+static uint32_t jit_map (void *memory, uint32_t num_words)
+{
+    return map_seg(memory, num_words);
+}
+
+static void jit_unmap (void *memory, uint32_t seg_id)
+{
+    unmap_seg(memory, seg_id);
 }
 
 static bool last_instruction (int *pc, UM_Mem m)
 {
-    if (*pc == segment_length(m, 0)){
+    if ((uint32_t) *pc == segment_length(m, 0)){
         return true;
     } else {
         return false;
@@ -393,66 +3074,67 @@ static inline uint32_t get_instruction(UM_Mem m, int *pc)
 static inline void handle_instruction (UM_Mem m, uint32_t encoded, 
                     uint32_t* registers, int *pc, bool *halt_flag)
 {
-
-    uint32_t opcode = Bitpack_getu(encoded, op_width, op_lsb);
-    uint32_t register_a=0, register_b=0, register_c=0, value=0; 
-
-    if (opcode == 13){
-        register_a = Bitpack_getu(encoded, reg_width, reg_a_lsb2);
-        value =      Bitpack_getu(encoded, value_width, value_lsb);
-    } else {
-        register_a = Bitpack_getu(encoded, reg_width, reg_a_lsb1);
-        register_b = Bitpack_getu(encoded, reg_width, reg_b_lsb);
-        register_c = Bitpack_getu(encoded, reg_width, reg_c_lsb);
+    if (!run_decoded(m, decode_word(encoded), registers, pc, halt_flag)) {
+        fail(m);
     }
+}
 
-    switch (opcode) {
-        case CMOV :
-            conditional_move (registers, register_a, register_b, register_c);
+/* executes d, the instruction before *pc, with the op helpers; returns 
+   false, having done nothing, if it is not a UM instruction. Forced 
+   inline: execute() gets the switch in its loop through 
+   handle_instruction(), whatever else calls it */
+static inline __attribute__((always_inline)) 
+bool run_decoded (UM_Mem m, Decoded d, uint32_t *registers, int *pc, 
+                  bool *halt_flag)
+{
+    switch (d.opcode) {
+        case CMOV:
+            conditional_move(registers, d.reg_a, d.reg_b, d.reg_c);
             break;
         case SLOAD:
-            segmented_load (m, registers, register_a, register_b, register_c);
+            segmented_load(m, registers, d.reg_a, d.reg_b, d.reg_c);
             break;
         case SSTORE:
-            segmented_store (m, registers, register_a, register_b, 
-                                register_c);
+            segmented_store(m, registers, d.reg_a, d.reg_b, d.reg_c);
             break;
         case ADD:
-            add(registers, register_a, register_b, register_c); 
+            add(registers, d.reg_a, d.reg_b, d.reg_c);
             break;
         case MUL:
-            multiply(registers, register_a, register_b, register_c);
+            multiply(registers, d.reg_a, d.reg_b, d.reg_c);
             break;
         case DIV:
-            divide(registers, register_a, register_b, register_c);
+            divide(registers, d.reg_a, d.reg_b, d.reg_c);
             break;
         case NAND:
-            bit_nand(registers, register_a, register_b, register_c);
-            break; 
+            bit_nand(registers, d.reg_a, d.reg_b, d.reg_c);
+            break;
         case HALT:
             halt(halt_flag);
             break;
         case MAP:
-            map_segment(m, registers, register_b, register_c);
+            map_segment(m, registers, d.reg_b, d.reg_c);
             break;
         case UNMAP:
-            unmap_segment(m, registers, register_c);
+            unmap_segment(m, registers, d.reg_c);
             break;
         case OUTPUT:
-            output(registers, register_c);
+            output(m, registers, d.reg_c);
             break;
         case INPUT:
-            input(registers, register_c); 
+            before_input(m, registers, *pc - 1);
+            input(m, registers, d.reg_c);
             break;
         case LOADP:
-            load_program(m, registers, register_b, register_c, pc);
+            load_program(m, registers, d.reg_b, d.reg_c, pc);
             break;
         case LOADV:
-            load_value(registers, register_a, value);
+            load_value(registers, d.reg_a, d.value);
             break;
         default:
-            exit(1);
+            return false;
     }
+    return true;
 }
 
 static inline void conditional_move(uint32_t* registers, uint32_t reg_a, 
@@ -475,10 +3157,7 @@ static inline void segmented_store (UM_Mem m, uint32_t* registers,
                     uint32_t reg_a, uint32_t reg_b, uint32_t reg_c)
 {
 
-    uint32_t *mem_loc = mem_address(m, registers[reg_a], registers[reg_b]);
-    
-    *mem_loc = registers[reg_c];
-    
+    store_word(m, registers[reg_a], registers[reg_b], registers[reg_c]);
 } 
 
 static inline void add (uint32_t* registers, uint32_t reg_a, uint32_t reg_b, 
@@ -516,8 +3195,7 @@ static inline void halt (bool* halt_flag)
 static inline void map_segment (UM_Mem m, uint32_t* registers, uint32_t reg_b, 
                              uint32_t reg_c)
 {
-    int num_words = registers[reg_c];
-    registers[reg_b] = map_seg(m, num_words);
+    registers[reg_b] = map_seg(m, registers[reg_c]);
 }
 
 
@@ -527,15 +3205,45 @@ static inline void unmap_segment (UM_Mem m, uint32_t* registers,
     unmap_seg(m, registers[reg_c]);
 }
 
-static inline void output (uint32_t* registers, 
+static inline void output (UM_Mem m, uint32_t* registers, 
                              uint32_t reg_c)
 {
-    fputc(registers[reg_c], stdout);
+    if (m -> embedded) {
+        unsigned char byte = registers[reg_c];
+        queue_put(&(m -> output), &byte, 1);
+        return;
+    }
+    Console *console = &(m -> console);
+    unsigned char byte = registers[reg_c];
+    /* a fault report flushes whatever is not half written */
+    console -> writing = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    console -> out[console -> out_length++] = byte;
+    if (console -> out_length == console_buffer 
+        || (console -> flush == FLUSH_LINE && byte == '\n')
+        || (console -> flush == FLUSH_TIMED 
+            && now_ns() - console -> last_flush >= console -> interval)) {
+        console_flush(m);
+    }
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    console -> writing = 0;
 } 
 
-static inline void input (uint32_t* registers, 
+static inline void input (UM_Mem m, uint32_t* registers, 
                              uint32_t reg_c){
-    int c = fgetc(stdin);
+    int c;
+    if (m -> embedded) {
+        unsigned char byte;
+        c = queue_take(&(m -> input), &byte, 1) == 1 ? byte : EOF;
+    } else {
+        Console *console = &(m -> console);
+        if (console -> in_start < console -> in_length 
+            || console_fill(m)) {
+            c = console -> in[console -> in_start++];
+        } else {
+            c = EOF;
+        }
+    }
     if (c < 0 || c > 255) {
         registers[reg_c] = UINT32_MAX;
     } else {
@@ -546,7 +3254,14 @@ static inline void input (uint32_t* registers,
 static inline void load_program (UM_Mem m, uint32_t* registers, 
                         uint32_t reg_b,  uint32_t reg_c, int *pc)
 {
+    if (m -> trace != NULL) {
+        trace_loadp(m, registers, *pc - 1, registers[reg_b], 
+                    registers[reg_c]);
+    }
     if (registers[reg_b] != 0) {
+        if (m -> checkpoint_file != NULL) {
+            before_load(m, registers, *pc - 1);
+        }
         load_segment(m, registers[reg_b]);
     }
     /* update program counter */
@@ -606,149 +3321,298 @@ static inline bool Bitpack_fitsu(uint64_t n, unsigned width)
 }
 
 
-static inline int Array_length (Array a)
+static inline uint32_t Array_length (Array a)
 {
     return a -> length;
 }
 
-static inline uint32_t* Array_at (Array a, int i)
+/* returns the Array whose elems are words */
+static inline Array Array_of (uint32_t *words)
+{
+    return (Array) ((char *) words - offsetof(struct Array, elems));
+}
+
+static inline uint32_t* Array_at (Array a, uint32_t i)
 {
     return &(a->elems[i]);
 
 } 
 
-static inline void Array_free (Array *a)
+/* puts the storage on the free list of its size class */
+static inline void Array_free (Pool pool, Array *a)
 {
-    free(*a);
+    /* restored from a snapshot, lives in its mapping until exit */
+    if ((*a) -> size_class == mapped_class) {
+        *a = NULL;
+        return;
+    }
+    /* large, goes back to the kernel so the next one is fresh zero pages */
+    if ((*a) -> size_class == mmap_class) {
+        munmap(*a, Array_bytes((*a) -> length));
+        *a = NULL;
+        return;
+    }
+    /* its mapping starts at the page it is on */
+    if ((*a) -> size_class == guarded_class) {
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        munmap((void *) ((uintptr_t) *a & ~(page - 1)), 
+               guarded_bytes((*a) -> length) + guard_bytes);
+        *a = NULL;
+        return;
+    }
+    Array *free_list = &(pool -> free_lists[(*a) -> size_class]);
+
+    memcpy((*a) -> elems, free_list, sizeof(*free_list));
+    *free_list = *a;
+    *a = NULL;
 } 
 
-static inline Array Array_copy (Array a, int length)
+/* drops one slot's share of the storage, freeing it with the last one */
+static inline void Array_release (Pool pool, Array *a)
 {
-    Array copy;
+    if (--(*a) -> refs == 0) {
+        Array_free(pool, a);
+    }
+}
 
-    copy = Array_new(length);
-    if( copy->length >= a->length && a->length > 0){
-        memcpy(copy->elems, a->elems, a->length*sizeof(*a->elems));
-    } else if (a->length > copy -> length && copy->length > 0){
-        memcpy(copy->elems, a->elems, copy->length*sizeof(*a->elems));
+static inline Array Array_copy (Pool pool, Array a, uint32_t length)
+{
+    Array copy = Pool_take(pool, length);
+    uint32_t shared = a -> length < length ? a -> length : length;
+
+    memcpy(copy->elems, a->elems, (size_t) shared * sizeof(*a->elems));
+    /* only pooled storage comes back dirty */
+    if (copy -> size_class >= 0) {
+        memset(copy->elems + shared, 0, 
+               (size_t) (length - shared) * sizeof(*a->elems));
     }
     return copy;
 } 
 
 
-static inline Array Array_new (int length)
+/* returns zeroed storage for length words, recycled when possible. Large
+   storage is already zero and left untouched, its pages are only faulted
+   in as the program uses them */
+static inline Array Array_new (Pool pool, uint32_t length)
 {
-    Array a = malloc(sizeof(*a) + length * sizeof(*a->elems));
-    a -> length = length;
-    for (int i = 0; i < length; i++){
-        a->elems[i] = 0;
+    Array a = Pool_take(pool, length);
+    if (a -> size_class >= 0) {
+        memset(a->elems, 0, (size_t) length * sizeof(*a->elems));
     }
     return a;
 }
 
-static inline Sequence Seq_new (int hint)
+static inline Pool Pool_new ()
 {
-    Sequence s = malloc(sizeof(*s));
-    s->capacity = hint;
-    s->Length = 0;
-    s->elems = malloc(hint * (sizeof(*(s->elems))));
-    return s;
+    Pool pool = malloc(sizeof(*pool));
+    for (int i = 0; i < num_size_classes; i++) {
+        pool -> free_lists[i] = NULL;
+    }
+    pool -> region = NULL;
+    pool -> region_used = 0;
+    pool -> region_usable = 0;
+    pool -> huge_pages = false;
+    return pool;
 }
 
-static inline void Seq_expand (Sequence s)
+/* returns uninitialized storage for length words from the smallest size 
+   class that fits, off its free list if it has one. From mmap_threshold 
+   words on it is mmap'd instead, and zero, except in an arena build */
+static inline Array Pool_take (Pool pool, uint32_t length)
 {
-    Array *new = malloc((s->capacity * 2) * (sizeof(*(s->elems))));
-    for (int i = 0; i < s->Length; i++){
-        new[i] = s->elems[i];
+    int size_class = min_size_class;
+#ifndef UM_ARENA
+    if (length >= mmap_threshold) {
+        Array a = pool -> region == NULL ? Array_map(length) 
+                                         : Array_guarded(length);
+        if (pool -> huge_pages) {
+            advise_huge_pages(a, Array_bytes(length));
+        }
+        return a;
     }
-    Array *temp = s->elems;
-    free(temp);
-    s->capacity = s->capacity * 2; 
-    s->elems = new;
-}
+#endif
+    if (length > (1 << min_size_class)) {
+        size_class = 32 - __builtin_clz(length - 1);
+    }
+    /* in an arena build large storage is pooled too, its id must point 
+       into the arena */
+    assert(size_class < num_size_classes);
 
-static inline void Seq_addhi (Sequence s, Array a)
-{
-    if (s -> Length == s-> capacity){
-        Seq_expand(s);
+    Array a = pool -> free_lists[size_class];
+    if (a != NULL) {
+        memcpy(&(pool -> free_lists[size_class]), a -> elems, sizeof(a));
+    } else {
+        size_t bytes = sizeof(*a) + ((size_t) 1 << size_class) 
+                                    * sizeof(*a->elems);
+        a = pool -> region == NULL ? malloc(bytes) : Pool_carve(pool, bytes);
+        assert(a != NULL);
+        a -> size_class = size_class;
     }
-    s->elems[s->Length] = a;
-    s->Length++;
+    a -> length = length;
+    a -> refs = 1;
+    return a;
 }
 
-static inline Array Seq_get (Sequence s, int index)
+/* returns zeroed storage for length words in a private anonymous mapping
+   of its own. MAP_NORESERVE lets a program map a huge table it will only 
+   touch a little of, it costs memory for the pages it uses */
+static inline Array Array_map (uint32_t length)
 {
-    return s->elems[index];
+    Array a = mmap(NULL, Array_bytes(length), PROT_READ | PROT_WRITE, 
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(a != MAP_FAILED);
+    a -> length = length;
+    a -> refs = 1;
+    a -> size_class = mmap_class;
+    return a;
 }
 
-static inline int Seq_length (Sequence s)
+/* --guard: returns zeroed storage for length words that ends where a 
+   guard_bytes PROT_NONE reservation starts, so a SLOAD or SSTORE up to 
+   16M words past the end faults instead of reaching other memory. The 
+   guard is address space only, it uses no memory */
+static inline Array Array_guarded (uint32_t length)
 {
-    return s->Length;
+    size_t data = guarded_bytes(length);
+    char *base = mmap(NULL, data + guard_bytes, PROT_NONE, 
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(base != MAP_FAILED);
+    int failed = mprotect(base, data, PROT_READ | PROT_WRITE);
+    assert(!failed);
+    (void) failed;
+
+    Array a = (Array) (base + data - Array_bytes(length));
+    a -> length = length;
+    a -> refs = 1;
+    a -> size_class = guarded_class;
+    return a;
 }
 
-static inline void Seq_put (Sequence s, int index, Array a)
+/* returns the size of the mapping of mmap'd storage for length words */
+static inline size_t Array_bytes (uint32_t length)
 {
-    s->elems[index] = a;
+    return sizeof(struct Array) + (size_t) length * sizeof(uint32_t);
 }
 
-static inline void Seq_free(Sequence *s)
+/* returns the bytes of guarded storage before its guard, whole pages */
+static inline size_t guarded_bytes (uint32_t length)
 {
-    free((*s)->elems);
-    free(*s);
-
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (Array_bytes(length) + page - 1) & ~(page - 1);
 }
 
-
-static inline Stack Stack_new ()
+/* reserves the address space pooled storage is carved from, instead of 
+   coming from malloc(). Under --guard a segment overrun then lands in 
+   other segments, never in the host's heap, and past the last block it 
+   faults. Under --huge-pages the segments are packed together on huge 
+   pages rather than scattered over the heap: the region is aligned to 
+   one and madvise()d */
+static inline void Pool_reserve (Pool pool)
 {
-    Stack s = malloc(sizeof(*s));
-    s->capacity = 50;
-    s->Length = 0;
-    s->elems = malloc(50 * (sizeof(*(s->elems))));
-    return s;
+    char *reserved = mmap(NULL, region_bytes + region_commit, PROT_NONE, 
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(reserved != MAP_FAILED);
+
+    char *region = (char *) (((uintptr_t) reserved + region_commit - 1) 
+                             & ~(uintptr_t) (region_commit - 1));
+    if (region > reserved) {
+        munmap(reserved, region - reserved);
+    }
+    munmap(region + region_bytes, reserved + region_commit - region);
+    pool -> region = region;
+    if (pool -> huge_pages) {
+        advise_huge_pages(region, region_bytes);
+    }
 }
 
-static inline void Stack_expand (Stack s)
+/* asks for transparent huge pages under the whole pages of bytes at 
+   address. It is only advice: nothing changes if the kernel has none */
+static inline void advise_huge_pages (void *address, size_t bytes)
 {
-    uint64_t *new = malloc((s->capacity * 2) * (sizeof(*(s->elems))));
-    for (int i = 0; i < s->Length; i++){
-        new[i] = s->elems[i];
-    }
-    s->capacity = s->capacity * 2; 
-    uint64_t *temp = s->elems;
-    free(temp);
-    s->elems = new;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) address & ~(page - 1);
+
+    madvise((void *) start, (uintptr_t) address + bytes - start, 
+            MADV_HUGEPAGE);
 }
 
-static inline void Stack_push (Stack s, uint64_t a)
+/* returns the next bytes of the region, making more of it usable when 
+   needed. Blocks are never given back, they stay on their free lists */
+static inline Array Pool_carve (Pool pool, size_t bytes)
 {
-    if (s -> Length == s-> capacity){
-        Stack_expand(s);
+    bytes = (bytes + snapshot_align - 1) & ~(size_t) (snapshot_align - 1);
+    if (pool -> region_used + bytes > pool -> region_usable) {
+        size_t grow = bytes > region_commit ? bytes : region_commit;
+        grow = (grow + region_commit - 1) & ~(region_commit - 1);
+        assert(pool -> region_usable + grow <= region_bytes);
+        int failed = mprotect(pool -> region + pool -> region_usable, grow, 
+                              PROT_READ | PROT_WRITE);
+        assert(!failed);
+        (void) failed;
+        pool -> region_usable += grow;
     }
-    s->elems[s->Length] = a;
-    s->Length++;
+    Array a = (Array) (pool -> region + pool -> region_used);
+    pool -> region_used += bytes;
+    return a;
 }
 
-static inline uint64_t Stack_pop (Stack s)
+static inline void Pool_free (Pool *pool)
 {
-    s->Length--;
-    return s->elems[s->Length];
-
+    if ((*pool) -> region != NULL) {
+        munmap((*pool) -> region, region_bytes);
+        free(*pool);
+        return;
+    }
+    for (int i = 0; i < num_size_classes; i++) {
+        Array a = (*pool) -> free_lists[i];
+        while (a != NULL) {
+            Array next;
+            memcpy(&next, a -> elems, sizeof(next));
+            free(a);
+            a = next;
+        }
+    }
+    free(*pool);
 }
 
-static inline bool Stack_empty(Stack s)
+/* appends size bytes to the queue, first dropping the ones already taken
+   if that makes room */
+static void queue_put (Byte_queue *queue, const unsigned char *bytes, 
+                       size_t size)
 {
-    if (s->Length == 0){
-        return true;
-    } else {
-        return false;
+    if (queue -> length + size > queue -> capacity && queue -> start > 0) {
+        memmove(queue -> bytes, queue -> bytes + queue -> start, 
+                queue -> length - queue -> start);
+        queue -> length -= queue -> start;
+        queue -> start = 0;
+    }
+    if (queue -> length + size > queue -> capacity) {
+        size_t capacity = queue -> capacity == 0 ? 4096 
+                                                 : queue -> capacity;
+        while (capacity < queue -> length + size) {
+            capacity *= 2;
+        }
+        queue -> bytes = realloc(queue -> bytes, capacity);
+        assert(queue -> bytes != NULL);
+        queue -> capacity = capacity;
     }
+    memcpy(queue -> bytes + queue -> length, bytes, size);
+    queue -> length += size;
 }
 
-static inline void Stack_free(Stack *s)
+/* moves up to size bytes off the front of the queue, returns how many */
+static size_t queue_take (Byte_queue *queue, unsigned char *bytes, 
+                          size_t size)
 {
-
-    free((*s)->elems);
-    free(*s);
-
-}
\ No newline at end of file
+    size_t available = queue -> length - queue -> start;
+    if (size > available) {
+        size = available;
+    }
+    memcpy(bytes, queue -> bytes + queue -> start, size);
+    queue -> start += size;
+    if (queue -> start == queue -> length) {
+        queue -> start = 0;
+        queue -> length = 0;
+    }
+    return size;
+}
@@ -0,0 +1,60 @@
+/**********************************************************************
+ *
+ *              um.h
+ *
+ *          Interface for embedding the UM (libum.a). A host creates a
+ *          machine from an image in memory, runs it a slice of
+ *          instructions at a time, and moves bytes in and out of it
+ *          itself; nothing touches stdin or stdout. Every machine is one
+ *          heap object holding all of its state, so any number of them
+ *          can be run side by side, one thread per machine at a time.
+ *          The only file-scope variables in um.c belong to the command
+ *          line's --guard and --sample signal handlers and to the
+ *          -DUM_FUSION_PROFILE build, none of which an embedded machine
+ *          uses.
+ *
+ *          Written by: Ballard Blair and Siddharth Kapoor
+ *
+ ********************************************************************/
+
+#ifndef UM_INCLUDED
+#define UM_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct UM_Mem *UM_Mem;
+
+/* why Um_run() returned */
+typedef enum Um_status {
+        UM_HALTED = 0,         /* ran HALT, runs no further */
+        UM_NEEDS_INPUT,        /* stopped on an INPUT with no byte queued */
+        UM_BUDGET_EXHAUSTED,   /* ran the number of instructions asked */
+        UM_FAILED              /* invalid opcode or pc past segment 0 */
+} Um_status;
+
+/* returns a machine about to run the big-endian .um image of size bytes,
+   which is copied */
+extern UM_Mem Um_new(const unsigned char *image, size_t size);
+
+/* runs at most budget instructions. An INPUT with nothing queued is left
+   unexecuted, so the next Um_run() after Um_put_input() retries it */
+extern Um_status Um_run(UM_Mem m, uint64_t budget);
+
+/* queues size bytes for INPUT to read */
+extern void Um_put_input(UM_Mem m, const unsigned char *bytes,
+                         size_t size);
+
+/* signals end of input: once the queue is empty INPUT reads all ones */
+extern void Um_end_input(UM_Mem m);
+
+/* moves up to size bytes of OUTPUT into bytes, returns how many */
+extern size_t Um_take_output(UM_Mem m, unsigned char *bytes, size_t size);
+
+/* returns the number of instructions the machine has retired */
+extern uint64_t Um_instructions(UM_Mem m);
+
+/* frees the machine and sets *m to NULL */
+extern void Um_free(UM_Mem *m);
+
+#endif
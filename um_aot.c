@@ -0,0 +1,373 @@
+/**********************************************************************
+ *
+ *              um_aot.c
+ *
+ *          Translates a UM image ahead of time into a C program, one
+ *          function per basic block of segment 0, that is built with
+ *          libum.a and runs the image without any translating of its
+ *          own (the interface is um_aot.h):
+ *
+ *              usage: um_aot IMAGE OUTPUT.c
+ *
+ *          Code is found by following segment 0 from pc 0: straight on
+ *          past every instruction but HALT and LOADP, and on to wherever
+ *          a LOADP may jump. That is only known at run time, so it is
+ *          guessed: the word after each LOADP, where a call returns, and
+ *          every LOADV value that is a pc of the image, since that is
+ *          how jump targets and return addresses are made, unless it is
+ *          first used as an SLOAD or SSTORE offset. A guess that was data
+ *          only costs a block nothing runs, which is dropped at the first
+ *          store to it; a jump the guesses miss, say to a computed
+ *          address, goes on in the interpreter.
+ *
+ *          Blocks start at those places and after each HALT, OUTPUT and
+ *          INPUT, which are left to the interpreter, and end at the next
+ *          start or at a LOADP.
+ *
+ *          Written by: Ballard Blair and Siddharth Kapoor
+ *
+ ********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+typedef enum Um_opcode {
+        CMOV = 0, SLOAD, SSTORE, ADD, MUL, DIV,
+        NAND, HALT, MAP, UNMAP, OUTPUT, INPUT, LOADP, LOADV
+} Um_opcode;
+
+/* what is known of a word of segment 0 */
+enum { REACHED = 1, ENTRY = 2 };
+
+/* the image being translated */
+typedef struct Image {
+    const char *name;
+    uint32_t *words;
+    uint32_t length;
+    uint8_t *flags;        /* REACHED and ENTRY, per word */
+    uint32_t *covered;     /* bit per word translated into some block */
+} Image;
+
+/* reads the big-endian image in filename */
+static void read_image(Image *image, const char *filename);
+
+/* sets the flags of every word, following the code from pc 0 */
+static void find_code(Image *image);
+
+/* marks pc as a place a LOADP may jump to, pushing it on work if it is
+   new */
+static void mark_entry(Image *image, uint32_t pc, uint32_t *work,
+                       uint32_t *num_work);
+
+/* returns true if the value the LOADV at pc loads is first used as an
+   offset to SLOAD or SSTORE at */
+static bool data_address(const Image *image, uint32_t pc);
+
+/* returns true for what blocks leave to the interpreter */
+static bool interpreted(uint32_t word);
+
+/* returns true if a block starts at pc */
+static bool starts_block(const Image *image, uint32_t pc);
+
+/* writes the block starting at start, marking the words it covers */
+static void write_block(FILE *fp, Image *image, uint32_t start);
+
+/* writes one instruction of a block, the last if it returns true */
+static bool write_instruction(FILE *fp, uint32_t word, uint32_t pc);
+
+/* writes the whole program, returns the number of blocks */
+static uint32_t write_program(FILE *fp, Image *image);
+
+
+int main(int argc, char *argv[])
+{
+    Image image;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s IMAGE OUTPUT.c\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    read_image(&image, argv[1]);
+    find_code(&image);
+
+    FILE *fp = fopen(argv[2], "w");
+    if (fp == NULL) {
+        perror(argv[2]);
+        return EXIT_FAILURE;
+    }
+    uint32_t num_blocks = write_program(fp, &image);
+    bool failed = ferror(fp) != 0;
+    if (fclose(fp) != 0 || failed) {
+        perror(argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    uint32_t covered = 0;
+    for (uint32_t pc = 0; pc < image.length; pc++) {
+        covered += (image.covered[pc / 32] >> (pc % 32)) & 1;
+    }
+    fprintf(stderr, "%s: %" PRIu32 " blocks, %" PRIu32 " of %" PRIu32
+            " words translated\n", argv[2], num_blocks, covered,
+            image.length);
+    free(image.words);
+    free(image.flags);
+    free(image.covered);
+    return 0;
+}
+
+/* reads the big-endian image in filename */
+static void read_image(Image *image, const char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    long size = fseek(fp, 0, SEEK_END) == 0 ? ftell(fp) : -1;
+    if (size < 0 || fseek(fp, 0, SEEK_SET) != 0) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+
+    image -> name = filename;
+    image -> length = size / 4;
+    image -> words = malloc((image -> length + 1) * sizeof(uint32_t));
+    image -> flags = calloc(image -> length + 1, 1);
+    image -> covered = calloc(image -> length / 32 + 1, sizeof(uint32_t));
+    assert(image -> words != NULL && image -> flags != NULL
+           && image -> covered != NULL);
+    for (uint32_t i = 0; i < image -> length; i++) {
+        unsigned char bytes[4];
+        if (fread(bytes, 1, 4, fp) != 4) {
+            fprintf(stderr, "%s: cannot read word %" PRIu32 "\n", filename,
+                    i);
+            exit(EXIT_FAILURE);
+        }
+        image -> words[i] = ((uint32_t) bytes[0] << 24) | (bytes[1] << 16)
+                            | (bytes[2] << 8) | bytes[3];
+    }
+    fclose(fp);
+}
+
+/* sets the flags of every word, following the code from pc 0. A run stops
+   at a word already reached, which was followed from there already */
+static void find_code(Image *image)
+{
+    uint32_t *work = malloc((image -> length + 1) * sizeof(uint32_t));
+    uint32_t num_work = 0;
+
+    assert(work != NULL);
+    mark_entry(image, 0, work, &num_work);
+    while (num_work > 0) {
+        uint32_t pc = work[--num_work];
+
+        for (; pc < image -> length && !(image -> flags[pc] & REACHED);
+             pc++) {
+            uint32_t word = image -> words[pc];
+            uint32_t opcode = word >> 28;
+
+            image -> flags[pc] |= REACHED;
+            if (opcode == LOADV && !data_address(image, pc)) {
+                mark_entry(image, word & 0x1ffffff, work, &num_work);
+            } else if (opcode == LOADP) {
+                mark_entry(image, pc + 1, work, &num_work);
+            }
+            if (opcode == HALT || opcode == LOADP || opcode > LOADV) {
+                break;
+            }
+        }
+    }
+    free(work);
+}
+
+/* marks pc as a place a LOADP may jump to, pushing it on work if it is
+   new */
+static void mark_entry(Image *image, uint32_t pc, uint32_t *work,
+                       uint32_t *num_work)
+{
+    if (pc < image -> length && !(image -> flags[pc] & ENTRY)) {
+        image -> flags[pc] |= ENTRY;
+        work[(*num_work)++] = pc;
+    }
+}
+
+/* returns true if the value the LOADV at pc loads is first used as an
+   offset to SLOAD or SSTORE at, looking no further than the run of code 
+   it is in. Programs keep data in segment 0 too; were it taken for code,
+   the first store to it would end the run of translated code */
+static bool data_address(const Image *image, uint32_t pc)
+{
+    unsigned loaded = (image -> words[pc] >> 25) & 7;
+
+    for (pc++; pc < image -> length; pc++) {
+        uint32_t word = image -> words[pc];
+        uint32_t opcode = word >> 28;
+        unsigned a = (word >> 6) & 7;
+        unsigned b = (word >> 3) & 7;
+        unsigned c = word & 7;
+
+        if (opcode == LOADV) {
+            if (((word >> 25) & 7) == loaded) {
+                return false;
+            }
+            continue;
+        }
+        if ((opcode == SLOAD && c == loaded)
+            || (opcode == SSTORE && b == loaded)) {
+            return true;
+        }
+        /* any other use, or the end of the run, and it may be a pc */
+        if (opcode == HALT || opcode == LOADP || opcode > LOADV
+            || a == loaded || b == loaded || c == loaded) {
+            return false;
+        }
+    }
+    return false;
+}
+
+/* returns true for what blocks leave to the interpreter: HALT, OUTPUT and
+   INPUT, and words that are no instruction at all */
+static bool interpreted(uint32_t word)
+{
+    uint32_t opcode = word >> 28;
+
+    return opcode == HALT || opcode == OUTPUT || opcode == INPUT
+           || opcode > LOADV;
+}
+
+/* returns true if a block starts at pc: where a LOADP may jump, or after
+   an instruction left to the interpreter, unless this one is too */
+static bool starts_block(const Image *image, uint32_t pc)
+{
+    if (!(image -> flags[pc] & REACHED)
+        || interpreted(image -> words[pc])) {
+        return false;
+    }
+    return (image -> flags[pc] & ENTRY)
+           || (pc > 0 && (image -> flags[pc - 1] & REACHED)
+               && interpreted(image -> words[pc - 1]));
+}
+
+/* writes the block starting at start, marking the words it covers. It
+   runs until the next block or an instruction left to the interpreter,
+   whose pc it returns, or up to a LOADP */
+static void write_block(FILE *fp, Image *image, uint32_t start)
+{
+    uint32_t pc = start;
+
+    fprintf(fp, "static uint32_t block_%" PRIu32 "(const Aot_runtime *rt, "
+            "uint32_t *r)\n{\n    AOT_ENTER(r);\n\n    (void) rt;\n", start);
+    for (;;) {
+        if (pc == image -> length
+            || (pc != start && starts_block(image, pc))
+            || interpreted(image -> words[pc])) {
+            fprintf(fp, "    AOT_LEAVE(r, %" PRIu32 ");\n", pc);
+            break;
+        }
+        image -> covered[pc / 32] |= (uint32_t) 1 << (pc % 32);
+        if (write_instruction(fp, image -> words[pc], pc)) {
+            break;
+        }
+        pc++;
+    }
+    fprintf(fp, "}\n\n");
+}
+
+/* writes one instruction of a block, the last if it returns true. A store
+   that dropped translated code leaves the block after it */
+static bool write_instruction(FILE *fp, uint32_t word, uint32_t pc)
+{
+    uint32_t opcode = word >> 28;
+    unsigned a = (word >> 6) & 7;
+    unsigned b = (word >> 3) & 7;
+    unsigned c = word & 7;
+
+    switch (opcode) {
+        case CMOV:
+            fprintf(fp, "    if (r%u != 0) r%u = r%u;", c, a, b);
+            break;
+        case SLOAD:
+            fprintf(fp, "    r%u = Aot_load(rt, r%u, r%u);", a, b, c);
+            break;
+        case SSTORE:
+            fprintf(fp, "    if (Aot_store(rt, r%u, r%u, r%u)) "
+                    "AOT_LEAVE(r, %" PRIu32 ");", a, b, c, pc + 1);
+            break;
+        case ADD:
+            fprintf(fp, "    r%u = r%u + r%u;", a, b, c);
+            break;
+        case MUL:
+            fprintf(fp, "    r%u = r%u * r%u;", a, b, c);
+            break;
+        case DIV:
+            fprintf(fp, "    r%u = r%u / r%u;", a, b, c);
+            break;
+        case NAND:
+            fprintf(fp, "    r%u = ~(r%u & r%u);", a, b, c);
+            break;
+        case MAP:
+            fprintf(fp, "    r%u = rt -> map(rt -> memory, r%u);", b, c);
+            break;
+        case UNMAP:
+            fprintf(fp, "    rt -> unmap(rt -> memory, r%u);", c);
+            break;
+        case LOADP:
+            /* another segment is the interpreter's to load */
+            fprintf(fp, "    if (r%u != 0) AOT_LEAVE(r, %" PRIu32 ");\n"
+                    "    AOT_LEAVE(r, r%u);", b, pc, c);
+            break;
+        case LOADV:
+            fprintf(fp, "    r%u = %" PRIu32 ";", (word >> 25) & 7,
+                    word & 0x1ffffff);
+            break;
+    }
+    fprintf(fp, "      /* %" PRIu32 " */\n", pc);
+    return opcode == LOADP;
+}
+
+/* writes the whole program: the image, the blocks, the table of blocks by
+   pc and the words they cover, and main() */
+static uint32_t write_program(FILE *fp, Image *image)
+{
+    uint32_t length = image -> length;
+    uint32_t num_blocks = 0;
+
+    fprintf(fp, "/* %s, translated by um_aot */\n\n#include \"um_aot.h\"\n\n"
+            "static const uint32_t image[] = {", image -> name);
+    for (uint32_t pc = 0; pc < length; pc++) {
+        fprintf(fp, "%s0x%08" PRIx32 ",", pc % 6 == 0 ? "\n    " : " ",
+                image -> words[pc]);
+    }
+    fprintf(fp, "%s\n};\n\n", length == 0 ? "\n    0" : "");
+
+    for (uint32_t pc = 0; pc < length; pc++) {
+        if (starts_block(image, pc)) {
+            write_block(fp, image, pc);
+            num_blocks++;
+        }
+    }
+
+    fprintf(fp, "static Aot_block *const blocks[%" PRIu32 "] = {\n",
+            length + 1);
+    for (uint32_t pc = 0; pc < length; pc++) {
+        if (starts_block(image, pc)) {
+            fprintf(fp, "    [%" PRIu32 "] = block_%" PRIu32 ",\n", pc, pc);
+        }
+    }
+    fprintf(fp, "    [%" PRIu32 "] = NULL\n};\n\n"
+            "static const uint32_t covered[] = {", length);
+    for (uint32_t i = 0; i <= length / 32; i++) {
+        fprintf(fp, "%s0x%08" PRIx32 ",", i % 6 == 0 ? "\n    " : " ",
+                image -> covered[i]);
+    }
+    fprintf(fp, "\n};\n\nstatic const Aot_program program = {\n"
+            "    image, %" PRIu32 ", blocks, covered\n};\n\n"
+            "int main(int argc, char const *argv[])\n{\n"
+            "    return Aot_main(argc, argv, &program);\n}\n", length);
+    return num_blocks;
+}
@@ -0,0 +1,106 @@
+/**********************************************************************
+ *
+ *              um_aot.h
+ *
+ *          Interface between um.c and the C that um_aot writes for a UM
+ *          image: one function per basic block of segment 0, with the
+ *          eight UM registers in locals. Blocks read segments inline
+ *          and call back into the UM_Mem runtime for everything else;
+ *          Aot_main() runs them and leaves to the interpreter whatever
+ *          was not translated, or no longer is what was.
+ *
+ *          Written by: Ballard Blair and Siddharth Kapoor
+ *
+ ********************************************************************/
+
+#ifndef UM_AOT_INCLUDED
+#define UM_AOT_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* one slot of the segment table, laid out as um.c's Segment */
+typedef struct Aot_segment {
+    uint32_t *words;       /* NULL while unmapped */
+    uint32_t length;
+    uint32_t next_free;
+} Aot_segment;
+
+/* runtime entry points called by translated code, memory is handed back
+   as the first argument of every call. *segments is the segment table,
+   which moves as it grows. A segment is only written inline while the int
+   refs_offset bytes from its words is 1, and in segment 0 only words no 
+   block was translated from */
+typedef struct Aot_runtime {
+    void *memory;
+    Aot_segment **segments;
+    int refs_offset;
+    const uint32_t *covered;       /* the program's */
+    /* returns nonzero if the store dropped translated code */
+    uint32_t (*sstore)(void *memory, uint32_t seg_id, uint32_t offset,
+                       uint32_t value);
+    uint32_t (*map)(void *memory, uint32_t num_words);
+    void (*unmap)(void *memory, uint32_t seg_id);
+} Aot_runtime;
+
+/* a translated block: runs with the given registers and returns the pc of
+   the next instruction to execute, its own pc if it cannot run the first
+   instruction itself */
+typedef uint32_t Aot_block(const Aot_runtime *runtime, uint32_t *registers);
+
+/* a translated image */
+typedef struct Aot_program {
+    const uint32_t *image;         /* segment 0 as translated */
+    uint32_t length;
+    Aot_block *const *blocks;      /* by pc, NULL where no block starts */
+    const uint32_t *covered;       /* bit per word some block translated */
+} Aot_program;
+
+/* runs the program on stdin and stdout, returns the exit status for
+   main(). It takes no options; argv[0] is only used in messages */
+extern int Aot_main(int argc, char const *argv[],
+                    const Aot_program *program);
+
+/* what a block starts and ends with: the registers are copied into locals
+   r0 to r7 and back out before it returns pc */
+#define AOT_ENTER(registers)                                            \
+        uint32_t r0 = (registers)[0], r1 = (registers)[1],              \
+                 r2 = (registers)[2], r3 = (registers)[3],              \
+                 r4 = (registers)[4], r5 = (registers)[5],              \
+                 r6 = (registers)[6], r7 = (registers)[7]
+
+#define AOT_LEAVE(registers, pc)                                        \
+        do {                                                            \
+            (registers)[0] = r0; (registers)[1] = r1;                   \
+            (registers)[2] = r2; (registers)[3] = r3;                   \
+            (registers)[4] = r4; (registers)[5] = r5;                   \
+            (registers)[6] = r6; (registers)[7] = r7;                   \
+            return (pc);                                                \
+        } while (0)
+
+/* SLOAD */
+static inline uint32_t Aot_load(const Aot_runtime *runtime,
+                                uint32_t seg_id, uint32_t offset)
+{
+    return (*runtime -> segments)[seg_id].words[offset];
+}
+
+/* SSTORE, returns nonzero if the block has to leave because the store
+   dropped translated code, which may be its own. Translated words and
+   shared storage are left to the runtime */
+static inline uint32_t Aot_store(const Aot_runtime *runtime,
+                                 uint32_t seg_id, uint32_t offset,
+                                 uint32_t value)
+{
+    uint32_t *words = (*runtime -> segments)[seg_id].words;
+
+    if (*(const int *) ((const char *) words + runtime -> refs_offset) == 1
+        && (seg_id != 0
+            || !((runtime -> covered[offset / 32] >> (offset % 32)) & 1))) {
+        words[offset] = value;
+        return 0;
+    }
+    return runtime -> sstore(runtime -> memory, seg_id, offset, value);
+}
+
+#endif
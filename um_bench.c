@@ -0,0 +1,336 @@
+/**********************************************************************
+ *
+ *              um_bench.c
+ *
+ *          Benchmark driver for the UM (make bench). Runs midmark,
+ *          sandmark and advent (advent-soln.txt on stdin) a few times
+ *          on every engine, checks each run's output against a stored
+ *          checksum and prints one tab separated line per run: wall
+ *          time, UM instructions retired, MIPS and peak RSS. With -b it
+ *          also compares the median times against a saved run. Images
+ *          made by um_gen are run instead when their BASENAMEs follow
+ *          the um.
+ *
+ *          usage: um_bench [-r runs] [-e engine,...] [-b baseline] 
+ *                          [um [BASENAME...]]
+ *
+ *          Written by: Ballard Blair and Siddharth Kapoor
+ *
+ ********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define max_runs 64
+#define max_engines 8
+#define fnv_offset 0xcbf29ce484222325ULL
+#define fnv_prime 0x100000001b3ULL
+
+/* a benchmark image and what a correct run of it looks like. instructions
+   is the count printed by um_profile --profile, it only depends on the
+   image and its input */
+typedef struct Benchmark {
+    const char *image;
+    const char *input;         /* fed on stdin, NULL for /dev/null */
+    uint64_t checksum;         /* FNV-1a of everything written to stdout */
+    uint64_t instructions;
+} Benchmark;
+
+static const Benchmark shipped[] = {
+    { "midmark.um",   NULL,              0x692839eedd2f6cddULL,   85070522 },
+    { "sandmark.umz", NULL,              0xc4882e6ad5f8fbc5ULL, 2113497561 },
+    { "advent.umz",   "advent-soln.txt", 0x8e7b4cc080bbd729ULL,  779013115 },
+};
+#define num_shipped (sizeof(shipped) / sizeof(shipped[0]))
+
+/* one run of one benchmark on one engine */
+typedef struct Result {
+    double seconds;
+    long max_rss_kb;
+    uint64_t checksum;
+    bool exited;               /* exit status 0 */
+} Result;
+
+/* runs um with --engine engine on the benchmark, returns how it went */
+static Result run_once(const char *um, const char *engine,
+                       const Benchmark *benchmark);
+
+/* returns the median of n seconds, sorting them */
+static double median(double *seconds, int n);
+
+/* returns the median time of image on engine recorded in a baseline
+   file, or a negative number if it has none */
+static double baseline_median(const char *baseline, const char *image,
+                              const char *engine);
+
+/* splits a comma separated list in place, returns the number of names */
+static int split_engines(char *list, char **engines);
+
+/* opens base followed by suffix for reading, exiting if there is no such 
+   file */
+static FILE *open_with_suffix(const char *base, const char *suffix);
+
+/* returns the benchmark for um_gen's BASENAME.um, checked against 
+   BASENAME.out and BASENAME.count */
+static Benchmark generated(const char *base);
+
+
+int main(int argc, char *argv[])
+{
+    const char *um = "./um";
+    const char *baseline = NULL;
+    char default_engines[] = "switch,threaded,jit";
+    char *engines[max_engines];
+    int num_engines = split_engines(default_engines, engines);
+    int runs = 3;
+    int failures = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:e:b:")) != -1) {
+        if (opt == 'r') {
+            runs = atoi(optarg);
+        } else if (opt == 'e') {
+            num_engines = split_engines(optarg, engines);
+        } else if (opt == 'b') {
+            baseline = optarg;
+        } else {
+            fprintf(stderr, "usage: %s [-r runs] [-e engine,...] "
+                            "[-b baseline] [um [BASENAME...]]\n", 
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind < argc) {
+        um = argv[optind++];
+    }
+
+    const Benchmark *benchmarks = shipped;
+    size_t num_benchmarks = num_shipped;
+    Benchmark *chosen = NULL;
+    if (optind < argc) {
+        num_benchmarks = argc - optind;
+        chosen = malloc(num_benchmarks * sizeof(*chosen));
+        assert(chosen != NULL);
+        for (size_t b = 0; b < num_benchmarks; b++) {
+            chosen[b] = generated(argv[optind + b]);
+        }
+        benchmarks = chosen;
+    }
+    if (runs < 1 || runs > max_runs) {
+        fprintf(stderr, "runs must be 1 to %d\n", max_runs);
+        return EXIT_FAILURE;
+    }
+
+    printf("# image\tengine\trun\tseconds\tinstructions\tmips\t"
+           "max_rss_kb\tchecksum\tstatus\n");
+    for (size_t b = 0; b < num_benchmarks; b++) {
+        const Benchmark *benchmark = &benchmarks[b];
+        for (int e = 0; e < num_engines; e++) {
+            double seconds[max_runs];
+            for (int r = 0; r < runs; r++) {
+                Result result = run_once(um, engines[e], benchmark);
+                bool ok = result.exited
+                          && result.checksum == benchmark -> checksum;
+                failures += !ok;
+                seconds[r] = result.seconds;
+                printf("%s\t%s\t%d\t%.3f\t%" PRIu64 "\t%.1f\t%ld\t"
+                       "%016" PRIx64 "\t%s\n",
+                       benchmark -> image, engines[e], r + 1,
+                       result.seconds, benchmark -> instructions,
+                       benchmark -> instructions / result.seconds / 1e6,
+                       result.max_rss_kb, result.checksum,
+                       ok ? "ok" : "FAIL");
+                fflush(stdout);
+            }
+
+            /* the median line is what baselines are compared on */
+            double mid = median(seconds, runs);
+            printf("%s\t%s\tmedian\t%.3f\t%" PRIu64 "\t%.1f",
+                   benchmark -> image, engines[e], mid,
+                   benchmark -> instructions,
+                   benchmark -> instructions / mid / 1e6);
+            if (baseline != NULL) {
+                double before = baseline_median(baseline,
+                                                benchmark -> image,
+                                                engines[e]);
+                if (before > 0) {
+                    printf("\tbaseline %.3f\t%+.1f%%", before,
+                           100.0 * (mid - before) / before);
+                }
+            }
+            printf("\n");
+            fflush(stdout);
+        }
+    }
+    free(chosen);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* runs um with --engine engine on the benchmark, returns how it went. The
+   output is hashed through a pipe rather than kept */
+static Result run_once(const char *um, const char *engine,
+                       const Benchmark *benchmark)
+{
+    Result result = { 0, 0, fnv_offset, false };
+    const char *input = benchmark -> input ? benchmark -> input
+                                           : "/dev/null";
+    struct timespec start, end;
+    int out[2];
+
+    int failed = pipe(out);
+    assert(!failed);
+    (void) failed;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        int in = open(input, O_RDONLY);
+        if (in < 0) {
+            perror(input);
+            _exit(127);
+        }
+        dup2(in, STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in);
+        close(out[0]);
+        close(out[1]);
+        execl(um, um, "--engine", engine, benchmark -> image,
+              (char *) NULL);
+        perror(um);
+        _exit(127);
+    }
+    close(out[1]);
+
+    unsigned char buffer[4096];
+    ssize_t n;
+    while ((n = read(out[0], buffer, sizeof(buffer))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            result.checksum = (result.checksum ^ buffer[i]) * fnv_prime;
+        }
+    }
+    close(out[0]);
+
+    int status;
+    struct rusage usage;
+    pid_t waited = wait4(pid, &status, 0, &usage);
+    assert(waited == pid);
+    (void) waited;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    result.seconds = (end.tv_sec - start.tv_sec)
+                     + (end.tv_nsec - start.tv_nsec) / 1e9;
+    result.max_rss_kb = usage.ru_maxrss;
+    result.exited = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    return result;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* returns the median of n seconds, sorting them */
+static double median(double *seconds, int n)
+{
+    qsort(seconds, n, sizeof(*seconds), compare_doubles);
+    if (n % 2 == 1) {
+        return seconds[n / 2];
+    }
+    return (seconds[n / 2 - 1] + seconds[n / 2]) / 2;
+}
+
+/* returns the median time of image on engine recorded in a baseline
+   file, or a negative number if it has none */
+static double baseline_median(const char *baseline, const char *image,
+                              const char *engine)
+{
+    FILE *fp = fopen(baseline, "r");
+    char line[512];
+    double found = -1;
+
+    if (fp == NULL) {
+        return found;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char name[128], engine_name[32], run[16];
+        double seconds;
+        if (sscanf(line, "%127s %31s %15s %lf", name, engine_name, run,
+                   &seconds) == 4
+            && strcmp(name, image) == 0
+            && strcmp(engine_name, engine) == 0
+            && strcmp(run, "median") == 0) {
+            found = seconds;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+/* splits a comma separated list in place, returns the number of names */
+static int split_engines(char *list, char **engines)
+{
+    int n = 0;
+    for (char *name = strtok(list, ","); name != NULL && n < max_engines;
+         name = strtok(NULL, ",")) {
+        engines[n++] = name;
+    }
+    return n;
+}
+
+/* opens base followed by suffix for reading, exiting if there is no such 
+   file */
+static FILE *open_with_suffix(const char *base, const char *suffix)
+{
+    char filename[4096];
+    snprintf(filename, sizeof(filename), "%s%s", base, suffix);
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    return fp;
+}
+
+/* returns the benchmark for um_gen's BASENAME.um, checked against 
+   BASENAME.out and BASENAME.count. The image name is kept for the life 
+   of the run */
+static Benchmark generated(const char *base)
+{
+    Benchmark benchmark = { NULL, NULL, fnv_offset, 0 };
+    size_t length = strlen(base) + sizeof(".um");
+    char *image = malloc(length);
+    int c;
+
+    assert(image != NULL);
+    snprintf(image, length, "%s.um", base);
+    benchmark.image = image;
+
+    FILE *out = open_with_suffix(base, ".out");
+    while ((c = getc(out)) != EOF) {
+        benchmark.checksum = (benchmark.checksum ^ (unsigned char) c) 
+                             * fnv_prime;
+    }
+    fclose(out);
+
+    FILE *count = open_with_suffix(base, ".count");
+    if (fscanf(count, "%" SCNu64, &benchmark.instructions) != 1) {
+        fprintf(stderr, "%s.count: no instruction count\n", base);
+        exit(EXIT_FAILURE);
+    }
+    fclose(count);
+    return benchmark;
+}
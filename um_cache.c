@@ -0,0 +1,208 @@
+/**********************************************************************
+ *
+ *              um_cache.c
+ *
+ *          The --code-cache directory. An artifact is one file: a page
+ *          holding a header that repeats its key and says what format
+ *          and page size it was written in, then the artifact itself,
+ *          page aligned so it can be mapped straight from the file.
+ *          Files are written under a temporary name and renamed into
+ *          place, so any number of runs can share a directory. Nothing
+ *          is ever removed; clearing the directory is always safe.
+ *
+ *          Written by: Ballard Blair and Siddharth Kapoor
+ *
+ ********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "um_cache.h"
+
+#define cache_magic "UMCACHE1"
+#define max_path 4096
+
+typedef struct Cache_header {
+    char magic[8];
+    uint64_t hash[2];
+    uint32_t length;
+    uint32_t format;
+    uint64_t bytes;
+    uint64_t page_size;    /* the artifact starts this far in */
+} Cache_header;
+
+/* sets path to the file of key and format in dir, returns false if it 
+   does not fit */
+static bool cache_path(char *path, const char *dir, Cache_key key,
+                       uint32_t format);
+
+/* writes size bytes to fd, returns false if it cannot */
+static bool write_bytes(int fd, const void *bytes, size_t size);
+
+/* returns the header of key for an artifact of bytes bytes */
+static Cache_header make_header(Cache_key key, uint32_t format,
+                                size_t bytes);
+
+
+/* returns the key of length words: two 64-bit hashes of the words taken
+   in pairs, with different multipliers and mixing, so a false match
+   needs both to collide */
+extern Cache_key Cache_key_of(const uint32_t *words, uint32_t length)
+{
+    uint64_t a = 0xcbf29ce484222325ULL ^ length;
+    uint64_t b = 0x9e3779b97f4a7c15ULL + length;
+    uint32_t i;
+    Cache_key key;
+
+    for (i = 0; i + 1 < length; i += 2) {
+        uint64_t pair = words[i] | ((uint64_t) words[i + 1] << 32);
+        a = (a ^ pair) * 0x100000001b3ULL;
+        b = (b + pair * 0xc2b2ae3d27d4eb4fULL);
+        b = ((b << 31) | (b >> 33)) * 0x9e3779b185ebca87ULL;
+    }
+    if (i < length) {
+        a = (a ^ words[i]) * 0x100000001b3ULL;
+        b = (b + words[i]) * 0x9e3779b185ebca87ULL;
+    }
+    /* spread the last pairs over all the bits */
+    a ^= a >> 33;
+    a *= 0xff51afd7ed558ccdULL;
+    a ^= a >> 33;
+    b ^= b >> 29;
+    b *= 0xc4ceb9fe1a85ec53ULL;
+    b ^= b >> 32;
+    key.hash[0] = a;
+    key.hash[1] = b;
+    key.length = length;
+    return key;
+}
+
+/* returns the artifact of bytes bytes in dir for key, built in format,
+   mapped private and writable, or NULL if there is none. Pages are read
+   from the file as they are touched */
+extern void *Cache_map(const char *dir, Cache_key key, uint32_t format,
+                       size_t bytes)
+{
+    char path[max_path];
+    Cache_header header;
+    Cache_header want = make_header(key, format, bytes);
+    struct stat info;
+    void *artifact = NULL;
+
+    if (!cache_path(path, dir, key, format)) {
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (pread(fd, &header, sizeof(header), 0) == sizeof(header)
+        && memcmp(&header, &want, sizeof(header)) == 0
+        && fstat(fd, &info) == 0
+        && (uint64_t) info.st_size >= header.page_size + bytes) {
+        artifact = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                        fd, header.page_size);
+        if (artifact == MAP_FAILED) {
+            artifact = NULL;
+        }
+    }
+    close(fd);
+    return artifact;
+}
+
+/* unmaps an artifact Cache_map() returned */
+extern void Cache_unmap(void *artifact, size_t bytes)
+{
+    munmap(artifact, bytes);
+}
+
+/* stores bytes of artifact in dir for key, making dir if need be. It is
+   written to a file of its own and renamed over whatever was there */
+extern void Cache_save(const char *dir, Cache_key key, uint32_t format,
+                       const void *artifact, size_t bytes)
+{
+    char path[max_path];
+    char temporary[max_path + 32];
+    Cache_header header = make_header(key, format, bytes);
+
+    if (!cache_path(path, dir, key, format)) {
+        return;
+    }
+    snprintf(temporary, sizeof(temporary), "%s.%d.tmp", path,
+             (int) getpid());
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        return;
+    }
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return;
+    }
+    unsigned char *page = calloc(1, header.page_size);
+    bool written = page != NULL;
+    if (written) {
+        memcpy(page, &header, sizeof(header));
+        written = write_bytes(fd, page, header.page_size)
+                  && write_bytes(fd, artifact, bytes);
+        free(page);
+    }
+    if (close(fd) != 0 || !written || rename(temporary, path) != 0) {
+        unlink(temporary);
+    }
+}
+
+/* sets path to the file of key and format in dir, returns false if it 
+   does not fit. Builds that predecode differently keep their own files */
+static bool cache_path(char *path, const char *dir, Cache_key key,
+                       uint32_t format)
+{
+    int n = snprintf(path, max_path, "%s/%016" PRIx64 "%016" PRIx64
+                     "-%" PRIu32 "-%" PRIx32, dir, key.hash[0],
+                     key.hash[1], key.length, format);
+    return n > 0 && n < max_path;
+}
+
+/* writes size bytes to fd, returns false if it cannot */
+static bool write_bytes(int fd, const void *bytes, size_t size)
+{
+    const char *next = bytes;
+
+    while (size > 0) {
+        ssize_t n = write(fd, next, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        next += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* returns the header of key for an artifact of bytes bytes, padding
+   zeroed so headers compare with memcmp() */
+static Cache_header make_header(Cache_key key, uint32_t format,
+                                size_t bytes)
+{
+    Cache_header header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, cache_magic, sizeof(header.magic));
+    header.hash[0] = key.hash[0];
+    header.hash[1] = key.hash[1];
+    header.length = key.length;
+    header.format = format;
+    header.bytes = bytes;
+    header.page_size = sysconf(_SC_PAGESIZE);
+    return header;
+}
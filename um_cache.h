@@ -0,0 +1,43 @@
+/**********************************************************************
+ *
+ *              um_cache.h
+ *
+ *          Interface for the code cache behind --code-cache: a directory
+ *          of artifacts built from a segment's words (its predecoded
+ *          copy), each in a file named by a hash of those words. A
+ *          later run that loads the same words maps the artifact in
+ *          copy-on-write instead of building it again.
+ *
+ *          Written by: Ballard Blair and Siddharth Kapoor
+ *
+ ********************************************************************/
+
+#ifndef UM_CACHE_INCLUDED
+#define UM_CACHE_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* names the words an artifact was built from */
+typedef struct Cache_key {
+    uint64_t hash[2];          /* two independent hashes of the words */
+    uint32_t length;           /* in words */
+} Cache_key;
+
+/* returns the key of length words */
+extern Cache_key Cache_key_of(const uint32_t *words, uint32_t length);
+
+/* returns the artifact of bytes bytes in dir for key, built in format,
+   mapped private and writable, or NULL if there is none */
+extern void *Cache_map(const char *dir, Cache_key key, uint32_t format,
+                       size_t bytes);
+
+/* unmaps an artifact Cache_map() returned */
+extern void Cache_unmap(void *artifact, size_t bytes);
+
+/* stores bytes of artifact in dir for key, replacing any other one at
+   once, so runs sharing dir never see half a file; gives up quietly */
+extern void Cache_save(const char *dir, Cache_key key, uint32_t format,
+                       const void *artifact, size_t bytes);
+
+#endif
@@ -0,0 +1,613 @@
+/**********************************************************************
+ *
+ *              um_gen.c
+ *
+ *          Generates synthetic UM images that each stress one part of
+ *          the machine, so a change can be timed per subsystem:
+ *
+ *              arith   - ADD/MUL/DIV/NAND loop, dispatch only
+ *              memory  - SLOAD/SSTORE walking a big segment
+ *              alloc   - MAP/UNMAP churn over a table of live segments
+ *              loadp   - LOADP ping-pong between two big segments
+ *              output  - OUTPUT of a character per iteration
+ *              selfmod - a loop that stores into its own code every
+ *                        iteration, for make check rather than timing
+ *
+ *          usage: um_gen KIND [-n iterations] [-w words] [-s min:max]
+ *                             [-l live] [-S seed] BASENAME
+ *
+ *          writes BASENAME.um, BASENAME.out (what a correct UM prints)
+ *          and BASENAME.count (UM instructions it retires). Both are
+ *          found by running the image on the small reference machine
+ *          at the bottom of this file, so they cannot drift from the
+ *          generated code. um_bench takes the BASENAMEs to time them.
+ *
+ *          Written by: Ballard Blair and Siddharth Kapoor
+ *
+ ********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+#include <math.h>
+
+typedef enum Um_opcode {
+        CMOV = 0, SLOAD, SSTORE, ADD, MUL, DIV,
+        NAND, HALT, MAP, UNMAP, OUTPUT, INPUT, LOADP, LOADV
+} Um_opcode;
+
+/* register conventions of every generated program: r0 stays 0, r6 stays
+   0xffffffff (adding it subtracts one), r7 counts loop iterations down and
+   r4/r5 are clobbered by every loop branch */
+enum { R0 = 0, R1, R2, R3, R4, R5, R6, R7 };
+
+#define max_loadv ((1u << 25) - 1)
+
+/* a UM program being assembled */
+typedef struct Program {
+    uint32_t *words;
+    uint32_t length;
+    uint32_t capacity;
+} Program;
+
+/* generation parameters, from the command line */
+typedef struct Options {
+    uint32_t iterations;
+    uint32_t words;        /* segment size for memory and loadp */
+    uint32_t min_size;     /* MAP sizes for alloc, log-uniform */
+    uint32_t max_size;
+    uint32_t live;         /* segments alloc keeps mapped at once */
+    uint32_t seed;
+} Options;
+
+/* appends a word to the program */
+static void append(Program *p, uint32_t word);
+
+/* appends a three register instruction */
+static void emit(Program *p, Um_opcode op, int a, int b, int c);
+
+/* appends a LOADV of value, which must fit in 25 bits */
+static void emit_loadv(Program *p, int a, uint32_t value);
+
+/* loads any 32-bit constant into a, using temp when it needs two parts */
+static void emit_constant(Program *p, int a, int temp, uint32_t value);
+
+/* decrements r7 and jumps back to top while it is nonzero, clobbering r4
+   and r5 */
+static void emit_loop_end(Program *p, uint32_t top);
+
+/* sets up r6 = ~0 and r7 = iterations */
+static void emit_prologue(Program *p, uint32_t iterations);
+
+/* prints the low byte of register a, clobbering r4 and r5 */
+static void emit_output_byte(Program *p, int a);
+
+/* returns the next number of a xorshift generator */
+static uint32_t next_random(uint32_t *state);
+
+/* the generators, each leaves a complete program in p */
+static void gen_arith(Program *p, const Options *options);
+static void gen_memory(Program *p, const Options *options);
+static void gen_alloc(Program *p, const Options *options);
+static void gen_loadp(Program *p, const Options *options);
+static void gen_output(Program *p, const Options *options);
+static void gen_selfmod(Program *p, const Options *options);
+
+/* runs the program on the reference machine, printing to output, and 
+   returns the number of instructions it retired */
+static uint64_t run_reference(const Program *p, FILE *output);
+
+/* writes the program as a big-endian .um image */
+static void write_image(const Program *p, const char *filename);
+
+/* closes fp, written as filename, exiting if anything written to it was 
+   lost */
+static void close_or_exit(FILE *fp, const char *filename);
+
+
+int main(int argc, char *argv[])
+{
+    Options options = { 10000000, 1 << 20, 1, 1024, 64, 1 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:w:s:l:S:")) != -1) {
+        if (opt == 'n') {
+            options.iterations = strtoul(optarg, NULL, 0);
+        } else if (opt == 'w') {
+            options.words = strtoul(optarg, NULL, 0);
+        } else if (opt == 's') {
+            if (sscanf(optarg, "%" SCNu32 ":%" SCNu32, &options.min_size,
+                       &options.max_size) != 2) {
+                options.min_size = 0;
+            }
+        } else if (opt == 'l') {
+            options.live = strtoul(optarg, NULL, 0);
+        } else if (opt == 'S') {
+            options.seed = strtoul(optarg, NULL, 0);
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (argc - optind != 2 || options.iterations == 0
+        || options.words == 0 || options.words > max_loadv
+        || options.min_size == 0 || options.min_size > options.max_size
+        || options.max_size > max_loadv
+        || options.live == 0 || options.live > 4096) {
+        fprintf(stderr, "usage: %s arith|memory|alloc|loadp|output|selfmod "
+                        "[-n iterations] [-w words] [-s min:max] "
+                        "[-l live] [-S seed] BASENAME\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *kind = argv[optind];
+    const char *base = argv[optind + 1];
+    Program program = { NULL, 0, 0 };
+
+    if (strcmp(kind, "arith") == 0) {
+        gen_arith(&program, &options);
+    } else if (strcmp(kind, "memory") == 0) {
+        gen_memory(&program, &options);
+    } else if (strcmp(kind, "alloc") == 0) {
+        gen_alloc(&program, &options);
+    } else if (strcmp(kind, "loadp") == 0) {
+        gen_loadp(&program, &options);
+    } else if (strcmp(kind, "output") == 0) {
+        gen_output(&program, &options);
+    } else if (strcmp(kind, "selfmod") == 0) {
+        gen_selfmod(&program, &options);
+    } else {
+        fprintf(stderr, "Unknown kind %s\n", kind);
+        return EXIT_FAILURE;
+    }
+
+    size_t length = strlen(base) + sizeof(".count");
+    char *filename = malloc(length);
+    assert(filename != NULL);
+
+    snprintf(filename, length, "%s.um", base);
+    write_image(&program, filename);
+
+    snprintf(filename, length, "%s.out", base);
+    FILE *output = fopen(filename, "w");
+    assert(output != NULL);
+    uint64_t instructions = run_reference(&program, output);
+    close_or_exit(output, filename);
+
+    snprintf(filename, length, "%s.count", base);
+    FILE *count = fopen(filename, "w");
+    assert(count != NULL);
+    fprintf(count, "%" PRIu64 "\n", instructions);
+    close_or_exit(count, filename);
+
+    printf("%s.um: %" PRIu32 " words, %" PRIu64 " instructions\n", base,
+           program.length, instructions);
+    free(filename);
+    free(program.words);
+    return EXIT_SUCCESS;
+}
+
+/* appends a word to the program */
+static void append(Program *p, uint32_t word)
+{
+    if (p -> length == p -> capacity) {
+        p -> capacity = p -> capacity == 0 ? 256 : 2 * p -> capacity;
+        p -> words = realloc(p -> words,
+                             p -> capacity * sizeof(*(p -> words)));
+        assert(p -> words != NULL);
+    }
+    p -> words[p -> length++] = word;
+}
+
+/* appends a three register instruction */
+static void emit(Program *p, Um_opcode op, int a, int b, int c)
+{
+    append(p, ((uint32_t) op << 28) | (a << 6) | (b << 3) | c);
+}
+
+/* appends a LOADV of value, which must fit in 25 bits */
+static void emit_loadv(Program *p, int a, uint32_t value)
+{
+    assert(value <= max_loadv);
+    append(p, ((uint32_t) LOADV << 28) | ((uint32_t) a << 25) | value);
+}
+
+/* loads any 32-bit constant into a, using temp when it needs two parts */
+static void emit_constant(Program *p, int a, int temp, uint32_t value)
+{
+    if (value <= max_loadv) {
+        emit_loadv(p, a, value);
+        return;
+    }
+    emit_loadv(p, a, value >> 16);
+    emit_loadv(p, temp, 1 << 16);
+    emit(p, MUL, a, a, temp);
+    emit_loadv(p, temp, value & 0xffff);
+    emit(p, ADD, a, a, temp);
+}
+
+/* decrements r7 and jumps back to top while it is nonzero, clobbering r4
+   and r5. The exit is the word after the LOADP */
+static void emit_loop_end(Program *p, uint32_t top)
+{
+    emit(p, ADD, R7, R7, R6);
+    emit_loadv(p, R4, p -> length + 4);
+    emit_loadv(p, R5, top);
+    emit(p, CMOV, R4, R5, R7);
+    emit(p, LOADP, 0, R0, R4);
+}
+
+/* sets up r6 = ~0 and r7 = iterations */
+static void emit_prologue(Program *p, uint32_t iterations)
+{
+    emit(p, NAND, R6, R0, R0);
+    emit_constant(p, R7, R5, iterations);
+}
+
+/* prints the low byte of register a, clobbering r4 and r5 */
+static void emit_output_byte(Program *p, int a)
+{
+    emit_loadv(p, R4, 255);
+    emit(p, NAND, R5, a, R4);
+    emit(p, NAND, R5, R5, R5);
+    emit(p, OUTPUT, 0, 0, R5);
+}
+
+/* ADD/MUL/DIV/NAND on registers only, the final values are printed */
+static void gen_arith(Program *p, const Options *options)
+{
+    emit_prologue(p, options -> iterations);
+    emit_loadv(p, R1, 12345);
+    emit_loadv(p, R2, 678);
+    emit_loadv(p, R3, 3);
+
+    uint32_t top = p -> length;
+    emit(p, ADD, R1, R1, R2);
+    emit(p, NAND, R2, R1, R3);
+    emit(p, MUL, R3, R3, R1);
+    emit(p, ADD, R3, R3, R7);
+    emit(p, DIV, R2, R2, R7);
+    emit(p, NAND, R1, R1, R2);
+    emit_loop_end(p, top);
+
+    emit_output_byte(p, R1);
+    emit_output_byte(p, R2);
+    emit_output_byte(p, R3);
+    emit(p, HALT, 0, 0, 0);
+}
+
+/* SLOAD/SSTORE over a segment of options->words words (rounded down to a
+   power of two so the index is a mask), then prints a checksum byte */
+static void gen_memory(Program *p, const Options *options)
+{
+    uint32_t words = 1;
+    while (2 * words <= options -> words) {
+        words *= 2;
+    }
+
+    emit_prologue(p, options -> iterations);
+    emit_loadv(p, R2, words);
+    emit(p, MAP, 0, R1, R2);
+
+    /* r3 = r7 * 2654435761 & (words - 1) scatters the walk */
+    uint32_t top = p -> length;
+    emit_constant(p, R3, R4, 2654435761u);
+    emit(p, MUL, R3, R3, R7);
+    emit_loadv(p, R4, words - 1);
+    emit(p, NAND, R3, R3, R4);
+    emit(p, NAND, R3, R3, R3);
+    emit(p, SLOAD, R2, R1, R3);
+    emit(p, ADD, R2, R2, R7);
+    emit(p, SSTORE, R1, R3, R2);
+    emit_loop_end(p, top);
+
+    emit(p, SLOAD, R2, R1, R0);
+    emit_output_byte(p, R2);
+    emit(p, HALT, 0, 0, 0);
+}
+
+/* returns the next number of a xorshift generator */
+static uint32_t next_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/* MAP/UNMAP churn: a table segment holds options->live segment ids, and
+   every iteration replaces a run of them with fresh segments of sizes
+   drawn log-uniformly from min:max. The sizes are baked into the code */
+static void gen_alloc(Program *p, const Options *options)
+{
+    enum { unrolled = 16 };
+    uint32_t state = options -> seed == 0 ? 1 : options -> seed;
+    uint32_t slot = 0;
+
+    emit_prologue(p, options -> iterations);
+    emit_loadv(p, R2, options -> live);
+    emit(p, MAP, 0, R1, R2);
+
+    /* fill the table so every slot has something to unmap */
+    for (uint32_t i = 0; i < options -> live; i++) {
+        emit_loadv(p, R3, i);
+        emit_loadv(p, R2, 1);
+        emit(p, MAP, 0, R2, R2);
+        emit(p, SSTORE, R1, R3, R2);
+    }
+
+    uint32_t top = p -> length;
+    for (int k = 0; k < unrolled; k++) {
+        double ratio = (double) options -> max_size / options -> min_size;
+        double unit = next_random(&state) / 4294967296.0;
+        uint32_t size = options -> min_size * exp(unit * log(ratio));
+        if (size > options -> max_size) {
+            size = options -> max_size;
+        }
+
+        emit_loadv(p, R3, slot);
+        emit(p, SLOAD, R2, R1, R3);
+        emit(p, UNMAP, 0, 0, R2);
+        emit_loadv(p, R2, size);
+        emit(p, MAP, 0, R2, R2);
+        emit(p, SSTORE, R2, R0, R7);
+        emit(p, SSTORE, R1, R3, R2);
+        slot = (slot + 1) % options -> live;
+    }
+    emit_loop_end(p, top);
+
+    /* the first word of the last segment mapped is 1, the r7 of the last
+       iteration */
+    emit(p, SLOAD, R2, R2, R0);
+    emit_output_byte(p, R2);
+    emit(p, HALT, 0, 0, 0);
+}
+
+/* LOADP ping-pong: segment 0 is padded to options->words words and copied
+   to segments 1 and 2, then every iteration loads each of them in turn */
+static void gen_loadp(Program *p, const Options *options)
+{
+    emit_prologue(p, options -> iterations);
+    emit_loadv(p, R1, options -> words);
+    emit(p, MAP, 0, R1, R1);
+    emit_loadv(p, R2, options -> words);
+    emit(p, MAP, 0, R2, R2);
+
+    /* copy segment 0 into both, counting r3 down from words */
+    emit_loadv(p, R3, options -> words);
+    uint32_t copy = p -> length;
+    emit(p, ADD, R3, R3, R6);
+    emit(p, SLOAD, R5, R0, R3);
+    emit(p, SSTORE, R1, R3, R5);
+    emit(p, SSTORE, R2, R3, R5);
+    emit_loadv(p, R4, p -> length + 4);
+    emit_loadv(p, R5, copy);
+    emit(p, CMOV, R4, R5, R3);
+    emit(p, LOADP, 0, R0, R4);
+
+    /* from here on the code runs from whichever copy is segment 0 */
+    uint32_t top = p -> length;
+    emit_loadv(p, R4, p -> length + 2);
+    emit(p, LOADP, 0, R1, R4);
+    emit_loadv(p, R4, p -> length + 2);
+    emit(p, LOADP, 0, R2, R4);
+    emit_loop_end(p, top);
+
+    emit_loadv(p, R3, 'L');
+    emit(p, OUTPUT, 0, 0, R3);
+    emit(p, HALT, 0, 0, 0);
+
+    assert(p -> length <= options -> words);
+    while (p -> length < options -> words) {
+        emit(p, HALT, 0, 0, 0);
+    }
+}
+
+/* prints one character per iteration, cycling through printable ASCII */
+static void gen_output(Program *p, const Options *options)
+{
+    emit_prologue(p, options -> iterations);
+    emit_loadv(p, R1, 63);
+    emit_loadv(p, R2, 32);
+
+    uint32_t top = p -> length;
+    emit(p, NAND, R3, R7, R1);
+    emit(p, NAND, R3, R3, R3);
+    emit(p, ADD, R3, R3, R2);
+    emit(p, OUTPUT, 0, 0, R3);
+    emit_loop_end(p, top);
+
+    emit_loadv(p, R3, '\n');
+    emit(p, OUTPUT, 0, 0, R3);
+    emit(p, HALT, 0, 0, 0);
+}
+
+/* a loop whose first word is a store putting back the word 127 on, which
+   it read in the prologue. Under the JIT that word is the last of the 
+   block entered at the second word (MAX_BLOCK in um_jit.c is 128) but not
+   of the block at the store, so once the blocks are chained the store 
+   drops the block the run entered at and returns its pc. That pc holds a
+   LOADV starting a superinstruction. Prints "AB" around the loop */
+static void gen_selfmod(Program *p, const Options *options)
+{
+    enum { block_words = 128 };
+
+    emit_prologue(p, options -> iterations);
+    emit_loadv(p, R1, 'A');
+    emit(p, OUTPUT, 0, 0, R1);
+
+    uint32_t store = p -> length + 4;
+    uint32_t top = store + 1;
+    emit_loadv(p, R3, top + block_words - 1);
+    emit(p, SLOAD, R1, R0, R3);
+    emit_loadv(p, R4, store);
+    emit(p, LOADP, 0, R0, R4);
+
+    assert(p -> length == store);
+    emit(p, SSTORE, R0, R3, R1);
+    emit_loadv(p, R4, 1);
+    emit(p, ADD, R2, R2, R4);
+    while (p -> length < top + block_words) {
+        emit(p, ADD, R2, R2, R0);
+    }
+    emit_loop_end(p, store);
+
+    emit_loadv(p, R1, 'B');
+    emit(p, OUTPUT, 0, 0, R1);
+    emit_loadv(p, R1, '\n');
+    emit(p, OUTPUT, 0, 0, R1);
+    emit(p, HALT, 0, 0, 0);
+}
+
+/* writes the program as a big-endian .um image */
+static void write_image(const Program *p, const char *filename)
+{
+    FILE *fp = fopen(filename, "wb");
+    assert(fp != NULL);
+    for (uint32_t i = 0; i < p -> length; i++) {
+        uint32_t word = p -> words[i];
+        unsigned char bytes[4] = { word >> 24, word >> 16, word >> 8, word };
+        fwrite(bytes, 1, sizeof(bytes), fp);
+    }
+    close_or_exit(fp, filename);
+}
+
+/* closes fp, written as filename, exiting if anything written to it was 
+   lost */
+static void close_or_exit(FILE *fp, const char *filename)
+{
+    bool failed = ferror(fp) != 0;
+    if (fclose(fp) != 0 || failed) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* one segment of the reference machine */
+typedef struct Reference_segment {
+    uint32_t *words;
+    uint32_t length;
+} Reference_segment;
+
+/* runs the program on the reference machine: the plainest UM that counts
+   what it retires. It stops on HALT and asserts on anything the generated
+   programs never do */
+static uint64_t run_reference(const Program *p, FILE *output)
+{
+    uint64_t instructions = 0;
+    uint32_t capacity = 16;
+    uint32_t used = 1;
+    Reference_segment *segments = calloc(capacity, sizeof(*segments));
+    uint32_t *free_ids = malloc(capacity * sizeof(*free_ids));
+    uint32_t num_free = 0;
+    uint32_t r[8] = { 0 };
+    uint32_t pc = 0;
+
+    assert(segments != NULL && free_ids != NULL);
+    segments[0].length = p -> length;
+    segments[0].words = malloc(p -> length * sizeof(uint32_t));
+    assert(segments[0].words != NULL);
+    memcpy(segments[0].words, p -> words, p -> length * sizeof(uint32_t));
+
+    for (;;) {
+        assert(pc < segments[0].length);
+        uint32_t word = segments[0].words[pc++];
+        uint32_t op = word >> 28;
+        uint32_t a = (word >> 6) & 7, b = (word >> 3) & 7, c = word & 7;
+        instructions++;
+
+        switch (op) {
+        case CMOV:
+            if (r[c] != 0) {
+                r[a] = r[b];
+            }
+            break;
+        case SLOAD:
+            assert(r[c] < segments[r[b]].length);
+            r[a] = segments[r[b]].words[r[c]];
+            break;
+        case SSTORE:
+            assert(r[b] < segments[r[a]].length);
+            segments[r[a]].words[r[b]] = r[c];
+            break;
+        case ADD:
+            r[a] = r[b] + r[c];
+            break;
+        case MUL:
+            r[a] = r[b] * r[c];
+            break;
+        case DIV:
+            assert(r[c] != 0);
+            r[a] = r[b] / r[c];
+            break;
+        case NAND:
+            r[a] = ~(r[b] & r[c]);
+            break;
+        case HALT:
+            for (uint32_t i = 0; i < used; i++) {
+                free(segments[i].words);
+            }
+            free(segments);
+            free(free_ids);
+            return instructions;
+        case MAP: {
+            uint32_t id;
+            if (num_free > 0) {
+                id = free_ids[--num_free];
+            } else {
+                if (used == capacity) {
+                    capacity *= 2;
+                    segments = realloc(segments,
+                                       capacity * sizeof(*segments));
+                    free_ids = realloc(free_ids,
+                                       capacity * sizeof(*free_ids));
+                    assert(segments != NULL && free_ids != NULL);
+                }
+                id = used++;
+            }
+            segments[id].length = r[c];
+            segments[id].words = calloc(r[c] + 1, sizeof(uint32_t));
+            assert(segments[id].words != NULL);
+            r[b] = id;
+            break;
+        }
+        case UNMAP:
+            assert(r[c] != 0 && segments[r[c]].words != NULL);
+            free(segments[r[c]].words);
+            segments[r[c]].words = NULL;
+            segments[r[c]].length = 0;
+            free_ids[num_free++] = r[c];
+            break;
+        case OUTPUT:
+            assert(r[c] < 256);
+            fputc(r[c], output);
+            break;
+        case LOADP:
+            if (r[b] != 0) {
+                Reference_segment *source = &segments[r[b]];
+                free(segments[0].words);
+                segments[0].length = source -> length;
+                segments[0].words = malloc((source -> length + 1)
+                                           * sizeof(uint32_t));
+                assert(segments[0].words != NULL);
+                memcpy(segments[0].words, source -> words,
+                       source -> length * sizeof(uint32_t));
+            }
+            pc = r[c];
+            break;
+        case LOADV:
+            r[(word >> 25) & 7] = word & max_loadv;
+            break;
+        default:
+            fprintf(stderr, "reference machine: bad opcode %" PRIu32
+                            " at %" PRIu32 "\n", op, pc - 1);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
@@ -0,0 +1,572 @@
+/**********************************************************************
+ *
+ *              um_jit.c
+ *
+ *          x86-64 baseline JIT for the Universal Machine. A block is the
+ *          run of segment 0 starting at some pc and ending before HALT,
+ *          OUTPUT, INPUT or an invalid opcode, after a LOADP, or after a
+ *          store that drops translated code. Blocks are emitted one after
+ *          another into a single mmap'd buffer; when it fills up, or
+ *          segment 0 is replaced, every translation is thrown away.
+ *
+ *          Blocks are chained: a block that ends by falling through or by
+ *          a LOADP jump looks its successor up in the bodies table and
+ *          jumps straight past the successor's prologue, so hot loops
+ *          only come back to execute_jit() for untranslated code and for
+ *          instructions the interpreter owns.
+ *
+ *          Register use inside a block:
+ *              r8d-r15d  UM registers 0-7
+ *              rbx       pointer to the registers array
+ *              eax, ecx, edx, esi, edi  scratch / call arguments
+ *          r8d-r11d are caller saved, so they are written back to the
+ *          registers array around every runtime call.
+ *
+ *          Written by: Ballard Blair and Siddharth Kapoor
+ *
+ ********************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include "um_jit.h"
+
+#define BUFFER_SIZE (32 << 20)      /* bytes of executable memory */
+#define MAX_BLOCK 128               /* instructions per block */
+#define MAX_INSTRUCTION_BYTES 256   /* worst case code for one instruction */
+
+/* host register numbers */
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSI 6
+#define RDI 7
+#define UM_REG(i) (8 + (i))
+
+typedef enum Jit_opcode {
+        CMOV = 0, SLOAD, SSTORE, ADD, MUL, DIV,
+        NAND, HALT, MAP, UNMAP, OUTPUT, INPUT, LOADP, LOADV
+} Jit_opcode;
+
+typedef struct Block {
+    Jit_block *entry;
+    uint32_t length;            /* segment 0 words covered */
+} Block;
+
+struct Jit {
+    Jit_runtime runtime;
+    uint8_t *buffer;
+    size_t used;
+    const uint32_t *code;       /* segment 0 words */
+    uint32_t length;
+    Block *blocks;              /* indexed by starting pc */
+    uint8_t **bodies;           /* code past each block's prologue, read by
+                                   translated code to chain blocks */
+    uint8_t *covered;           /* number of live blocks covering a word */
+};
+
+
+/* drops every block and empties the code buffer */
+static void flush_code(Jit jit);
+
+/* translates the block starting at start, NULL if nothing was emitted */
+static Jit_block *translate(Jit jit, uint32_t start);
+
+/* true if the interpreter has to run this opcode */
+static inline bool interpreted(uint32_t opcode);
+
+static inline void emit_byte(Jit jit, uint8_t byte);
+static inline void emit_u32(Jit jit, uint32_t value);
+static inline void emit_u64(Jit jit, uint64_t value);
+
+/* emits op reg, rm with both operands registers, op is one byte or a 0x0F
+   escaped pair such as 0x0FAF */
+static inline void emit_rr(Jit jit, bool wide, unsigned op, unsigned reg,
+                           unsigned rm);
+
+/* emits op reg, [rbx + disp] */
+static inline void emit_rbx(Jit jit, unsigned op, unsigned reg,
+                            uint8_t disp);
+
+/* emits a jcc rel32 with a zero offset and returns where to patch it */
+static inline size_t emit_jcc(Jit jit, uint8_t condition);
+
+/* emits a jmp rel32 with a zero offset and returns where to patch it */
+static inline size_t emit_jump(Jit jit);
+
+/* points the jump emitted at patch to the current position */
+static inline void patch_jump(Jit jit, size_t patch);
+
+/* leaves the address of segment[seg][0] in rax and offset in rdx, seg and
+   offset being UM registers */
+static void emit_word_address(Jit jit, unsigned seg, unsigned offset);
+
+/* emits op reg, segment word addressed by emit_word_address(), that is
+   [rax + rdx*4] */
+static void emit_word_access(Jit jit, unsigned op, unsigned reg);
+
+/* loads the registers, saving the callee saved registers the block uses */
+static void emit_prologue(Jit jit);
+
+/* writes UM registers back to the registers array */
+static void emit_store_registers(Jit jit);
+
+/* restores the callee saved registers and returns */
+static void emit_return(Jit jit);
+
+/* writes the registers back and returns pc from the block */
+static void emit_exit(Jit jit, uint32_t pc);
+
+/* continues at the block starting at the pc in eax, leaving through 
+   emit_exit() if it is not translated */
+static void emit_chain(Jit jit);
+
+/* calls a runtime function, arguments already in esi/edx/ecx */
+static void emit_call(Jit jit, uint64_t function);
+
+
+/* returns a new JIT, or NULL if no executable memory can be had */
+extern Jit Jit_new(Jit_runtime runtime)
+{
+    uint8_t *buffer = mmap(NULL, BUFFER_SIZE,
+                           PROT_READ | PROT_WRITE | PROT_EXEC,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        return NULL;
+    }
+    if (runtime.huge_pages) {
+        madvise(buffer, BUFFER_SIZE, MADV_HUGEPAGE);
+    }
+
+    Jit jit = malloc(sizeof(*jit));
+    assert(jit != NULL);
+    jit -> runtime = runtime;
+    jit -> buffer = buffer;
+    jit -> used = 0;
+    jit -> code = NULL;
+    jit -> length = 0;
+    jit -> blocks = NULL;
+    jit -> bodies = NULL;
+    jit -> covered = NULL;
+    return jit;
+}
+
+/* frees the JIT and its code buffer */
+extern void Jit_free(Jit *jit)
+{
+    munmap((*jit) -> buffer, BUFFER_SIZE);
+    free((*jit) -> blocks);
+    free((*jit) -> bodies);
+    free((*jit) -> covered);
+    free(*jit);
+    *jit = NULL;
+}
+
+/* drops every translation, code is the new segment 0 of length words */
+extern void Jit_reset(Jit jit, const uint32_t *code, uint32_t length)
+{
+    jit -> code = code;
+    jit -> length = length;
+    jit -> blocks = realloc(jit -> blocks,
+                            (length + 1) * sizeof(*(jit -> blocks)));
+    jit -> bodies = realloc(jit -> bodies,
+                            (length + 1) * sizeof(*(jit -> bodies)));
+    jit -> covered = realloc(jit -> covered, length + 1);
+    assert(jit -> blocks != NULL && jit -> bodies != NULL 
+           && jit -> covered != NULL);
+    flush_code(jit);
+}
+
+/* returns the block starting at pc, translating it on a miss, or NULL if
+   the instruction at pc has to be interpreted */
+extern Jit_block *Jit_lookup(Jit jit, uint32_t pc)
+{
+    Jit_block *entry = jit -> blocks[pc].entry;
+
+    if (entry != NULL) {
+        return entry;
+    }
+    if (interpreted(jit -> code[pc] >> 28)) {
+        return NULL;
+    }
+    return translate(jit, pc);
+}
+
+/* drops every block covering segment 0 word offset, returns true if there
+   was one */
+extern bool Jit_invalidate(Jit jit, uint32_t offset)
+{
+    if (offset >= jit -> length || jit -> covered[offset] == 0) {
+        return false;
+    }
+
+    uint32_t first = offset >= MAX_BLOCK ? offset - MAX_BLOCK + 1 : 0;
+    for (uint32_t start = first; start <= offset; start++) {
+        Block *block = &jit -> blocks[start];
+        if (block -> entry != NULL && start + block -> length > offset) {
+            for (uint32_t i = 0; i < block -> length; i++) {
+                jit -> covered[start + i]--;
+            }
+            block -> entry = NULL;
+            block -> length = 0;
+            jit -> bodies[start] = NULL;
+        }
+    }
+    return true;
+}
+
+/* returns true if address is in translated code, which keeps UM register 
+   i in host register r(8 + i) */
+extern bool Jit_owns(Jit jit, const void *address)
+{
+    const uint8_t *byte = address;
+    return byte >= jit -> buffer && byte < jit -> buffer + jit -> used;
+}
+
+/* drops every block and empties the code buffer */
+static void flush_code(Jit jit)
+{
+    jit -> used = 0;
+    memset(jit -> blocks, 0, (jit -> length + 1) * sizeof(*(jit -> blocks)));
+    memset(jit -> bodies, 0, (jit -> length + 1) * sizeof(*(jit -> bodies)));
+    memset(jit -> covered, 0, jit -> length + 1);
+}
+
+/* true if the interpreter has to run this opcode */
+static inline bool interpreted(uint32_t opcode)
+{
+    return opcode == HALT || opcode == OUTPUT || opcode == INPUT
+           || opcode > LOADV;
+}
+
+/* translates the block starting at start, NULL if nothing was emitted */
+static Jit_block *translate(Jit jit, uint32_t start)
+{
+    if (BUFFER_SIZE - jit -> used < MAX_BLOCK * MAX_INSTRUCTION_BYTES) {
+        flush_code(jit);
+    }
+
+    union {
+        uint8_t *bytes;
+        Jit_block *function;
+    } entry = { jit -> buffer + jit -> used };
+    uint32_t pc = start;
+    bool ended = false;
+    size_t patch, shared, done;
+
+    emit_prologue(jit);
+    uint8_t *body = jit -> buffer + jit -> used;
+    while (!ended && pc < jit -> length && pc - start < MAX_BLOCK) {
+        uint32_t word = jit -> code[pc];
+        uint32_t opcode = word >> 28;
+        unsigned a = UM_REG((word >> 6) & 7);
+        unsigned b = UM_REG((word >> 3) & 7);
+        unsigned c = UM_REG(word & 7);
+
+        if (interpreted(opcode)) {
+            break;
+        }
+        switch (opcode) {
+            case CMOV:
+                emit_rr(jit, false, 0x85, c, c);        /* test c, c */
+                emit_rr(jit, false, 0x0F45, a, b);      /* cmovne a, b */
+                break;
+            case SLOAD:
+                emit_word_address(jit, b, c);
+                emit_word_access(jit, 0x8B, a);         /* mov a, word */
+                break;
+            case SSTORE:
+                /* stores into segment 0 or into shared storage go through
+                   the runtime, which keeps the decoded and translated 
+                   copies in step and unshares the segment */
+                emit_rr(jit, false, 0x85, a, a);
+                patch = emit_jcc(jit, 0x84);            /* jz */
+                emit_word_address(jit, a, b);
+                emit_byte(jit, 0x83);                   /* cmp refs, 1 */
+                emit_byte(jit, 0x78);
+                emit_byte(jit, jit -> runtime.refs_offset);
+                emit_byte(jit, 1);
+                shared = emit_jcc(jit, 0x85);           /* jne */
+                emit_word_access(jit, 0x89, c);         /* mov word, c */
+                done = emit_jump(jit);
+                patch_jump(jit, patch);
+                patch_jump(jit, shared);
+                emit_rr(jit, false, 0x89, a, RSI);
+                emit_rr(jit, false, 0x89, b, RDX);
+                emit_rr(jit, false, 0x89, c, RCX);
+                emit_call(jit, (uintptr_t) jit -> runtime.sstore);
+                /* leave the block if the store dropped translated code,
+                   which may be this very block */
+                emit_rr(jit, false, 0x85, RAX, RAX);
+                patch = emit_jcc(jit, 0x84);            /* jz */
+                emit_exit(jit, pc + 1);
+                patch_jump(jit, patch);
+                patch_jump(jit, done);
+                break;
+            case ADD:
+                emit_rr(jit, false, 0x89, b, RAX);
+                emit_rr(jit, false, 0x03, RAX, c);      /* add eax, c */
+                emit_rr(jit, false, 0x89, RAX, a);
+                break;
+            case MUL:
+                emit_rr(jit, false, 0x89, b, RAX);
+                emit_rr(jit, false, 0x0FAF, RAX, c);    /* imul eax, c */
+                emit_rr(jit, false, 0x89, RAX, a);
+                break;
+            case DIV:
+                emit_rr(jit, false, 0x89, b, RAX);
+                emit_rr(jit, false, 0x31, RDX, RDX);    /* xor edx, edx */
+                emit_rr(jit, false, 0xF7, 6, c);        /* div c */
+                emit_rr(jit, false, 0x89, RAX, a);
+                break;
+            case NAND:
+                emit_rr(jit, false, 0x89, b, RAX);
+                emit_rr(jit, false, 0x23, RAX, c);      /* and eax, c */
+                emit_rr(jit, false, 0xF7, 2, RAX);      /* not eax */
+                emit_rr(jit, false, 0x89, RAX, a);
+                break;
+            case MAP:
+                emit_rr(jit, false, 0x89, c, RSI);
+                emit_call(jit, (uintptr_t) jit -> runtime.map);
+                emit_rr(jit, false, 0x89, RAX, b);
+                break;
+            case UNMAP:
+                emit_rr(jit, false, 0x89, c, RSI);
+                emit_call(jit, (uintptr_t) jit -> runtime.unmap);
+                break;
+            case LOADP:
+                /* a jump within segment 0 stays in the block, loading
+                   another segment is left to the interpreter */
+                emit_rr(jit, false, 0x85, b, b);
+                patch = emit_jcc(jit, 0x84);            /* jz */
+                emit_exit(jit, pc);
+                patch_jump(jit, patch);
+                emit_rr(jit, false, 0x89, c, RAX);
+                emit_chain(jit);
+                ended = true;
+                break;
+            case LOADV:
+                a = UM_REG((word >> 25) & 7);
+                emit_byte(jit, 0x41);                   /* mov a, imm32 */
+                emit_byte(jit, 0xB8 + (a & 7));
+                emit_u32(jit, word & 0x1FFFFFF);
+                break;
+        }
+        pc++;
+    }
+
+    if (pc == start) {
+        jit -> used = entry.bytes - jit -> buffer;
+        return NULL;
+    }
+    if (!ended) {
+        emit_byte(jit, 0xB8);                           /* mov eax, pc */
+        emit_u32(jit, pc);
+        emit_chain(jit);
+    }
+
+    jit -> blocks[start].entry = entry.function;
+    jit -> blocks[start].length = pc - start;
+    jit -> bodies[start] = body;
+    for (uint32_t i = start; i < pc; i++) {
+        jit -> covered[i]++;
+    }
+    return entry.function;
+}
+
+static inline void emit_byte(Jit jit, uint8_t byte)
+{
+    jit -> buffer[jit -> used++] = byte;
+}
+
+static inline void emit_u32(Jit jit, uint32_t value)
+{
+    memcpy(jit -> buffer + jit -> used, &value, sizeof(value));
+    jit -> used += sizeof(value);
+}
+
+static inline void emit_u64(Jit jit, uint64_t value)
+{
+    memcpy(jit -> buffer + jit -> used, &value, sizeof(value));
+    jit -> used += sizeof(value);
+}
+
+/* emits op reg, rm with both operands registers, op is one byte or a 0x0F
+   escaped pair such as 0x0FAF */
+static inline void emit_rr(Jit jit, bool wide, unsigned op, unsigned reg,
+                           unsigned rm)
+{
+    uint8_t rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (rm >> 3);
+
+    if (rex != 0x40) {
+        emit_byte(jit, rex);
+    }
+    if (op > 0xFF) {
+        emit_byte(jit, op >> 8);
+    }
+    emit_byte(jit, op & 0xFF);
+    emit_byte(jit, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* emits op reg, [rbx + disp] */
+static inline void emit_rbx(Jit jit, unsigned op, unsigned reg,
+                            uint8_t disp)
+{
+    if (reg >= 8) {
+        emit_byte(jit, 0x44);
+    }
+    emit_byte(jit, op);
+    emit_byte(jit, 0x40 | ((reg & 7) << 3) | RBX);
+    emit_byte(jit, disp);
+}
+
+/* emits a jcc rel32 with a zero offset and returns where to patch it */
+static inline size_t emit_jcc(Jit jit, uint8_t condition)
+{
+    emit_byte(jit, 0x0F);
+    emit_byte(jit, condition);
+    emit_u32(jit, 0);
+    return jit -> used;
+}
+
+/* emits a jmp rel32 with a zero offset and returns where to patch it */
+static inline size_t emit_jump(Jit jit)
+{
+    emit_byte(jit, 0xE9);
+    emit_u32(jit, 0);
+    return jit -> used;
+}
+
+/* points the jump emitted at patch to the current position */
+static inline void patch_jump(Jit jit, size_t patch)
+{
+    uint32_t offset = jit -> used - patch;
+    memcpy(jit -> buffer + patch - sizeof(offset), &offset, sizeof(offset));
+}
+
+/* leaves the address of segment[seg][0] in rax and offset in rdx, seg and
+   offset being UM registers */
+static void emit_word_address(Jit jit, unsigned seg, unsigned offset)
+{
+    emit_byte(jit, 0x48);                       /* mov rax, segments */
+    emit_byte(jit, 0xB8 + RAX);
+    emit_u64(jit, (uintptr_t) jit -> runtime.segments);
+    emit_byte(jit, 0x48);                       /* mov rax, [rax] */
+    emit_byte(jit, 0x8B);
+    emit_byte(jit, 0x00);
+    emit_rr(jit, false, 0x89, seg, RDX);        /* mov edx, seg */
+    emit_byte(jit, 0x48);                       /* shl rdx, 4 */
+    emit_byte(jit, 0xC1);
+    emit_byte(jit, 0xE2);
+    emit_byte(jit, 4);
+    emit_byte(jit, 0x48);                       /* mov rax, [rax + rdx] */
+    emit_byte(jit, 0x8B);
+    emit_byte(jit, 0x04);
+    emit_byte(jit, 0x10);
+    emit_rr(jit, false, 0x89, offset, RDX);     /* mov edx, offset */
+}
+
+/* emits op reg, segment word addressed by emit_word_address(), that is
+   [rax + rdx*4] */
+static void emit_word_access(Jit jit, unsigned op, unsigned reg)
+{
+    if (reg >= 8) {
+        emit_byte(jit, 0x44);
+    }
+    emit_byte(jit, op);
+    emit_byte(jit, 0x04 | ((reg & 7) << 3));
+    emit_byte(jit, 0x90);
+}
+
+/* loads the registers, saving the callee saved registers the block uses */
+static void emit_prologue(Jit jit)
+{
+    emit_byte(jit, 0x53);                               /* push rbx */
+    for (unsigned r = 12; r <= 15; r++) {               /* push r12-r15 */
+        emit_byte(jit, 0x41);
+        emit_byte(jit, 0x50 + (r & 7));
+    }
+    emit_rr(jit, true, 0x89, RDI, RBX);                 /* mov rbx, rdi */
+    for (unsigned i = 0; i < 8; i++) {
+        emit_rbx(jit, 0x8B, UM_REG(i), 4 * i);
+    }
+}
+
+/* writes UM registers back to the registers array */
+static void emit_store_registers(Jit jit)
+{
+    for (unsigned i = 0; i < 8; i++) {
+        emit_rbx(jit, 0x89, UM_REG(i), 4 * i);
+    }
+}
+
+/* restores the callee saved registers and returns */
+static void emit_return(Jit jit)
+{
+    for (unsigned r = 15; r >= 12; r--) {               /* pop r15-r12 */
+        emit_byte(jit, 0x41);
+        emit_byte(jit, 0x58 + (r & 7));
+    }
+    emit_byte(jit, 0x5B);                               /* pop rbx */
+    emit_byte(jit, 0xC3);                               /* ret */
+}
+
+/* writes the registers back and returns pc from the block */
+static void emit_exit(Jit jit, uint32_t pc)
+{
+    emit_store_registers(jit);
+    emit_byte(jit, 0xB8);                               /* mov eax, pc */
+    emit_u32(jit, pc);
+    emit_return(jit);
+}
+
+/* continues at the block starting at the pc in eax, leaving through 
+   emit_exit() if it is not translated */
+static void emit_chain(Jit jit)
+{
+    size_t past_end, missing;
+
+    emit_byte(jit, 0x3D);                               /* cmp eax, length */
+    emit_u32(jit, jit -> length);
+    past_end = emit_jcc(jit, 0x83);                     /* jae */
+    emit_byte(jit, 0x48);                               /* mov rdx, bodies */
+    emit_byte(jit, 0xB8 + RDX);
+    emit_u64(jit, (uintptr_t) jit -> bodies);
+    emit_byte(jit, 0x48);                       /* mov rdx, [rdx + rax*8] */
+    emit_byte(jit, 0x8B);
+    emit_byte(jit, 0x14);
+    emit_byte(jit, 0xC2);
+    emit_rr(jit, true, 0x85, RDX, RDX);                 /* test rdx, rdx */
+    missing = emit_jcc(jit, 0x84);                      /* jz */
+    emit_byte(jit, 0xFF);                               /* jmp rdx */
+    emit_byte(jit, 0xE2);
+    patch_jump(jit, past_end);
+    patch_jump(jit, missing);
+    emit_store_registers(jit);                  /* return eax untouched */
+    emit_return(jit);
+}
+
+/* calls a runtime function, arguments already in esi/edx/ecx. Five pushes
+   in the prologue leave rsp 16-byte aligned here */
+static void emit_call(Jit jit, uint64_t function)
+{
+    for (unsigned i = 0; i < 4; i++) {
+        emit_rbx(jit, 0x89, UM_REG(i), 4 * i);
+    }
+    emit_byte(jit, 0x48);                               /* mov rdi, imm64 */
+    emit_byte(jit, 0xB8 + RDI);
+    emit_u64(jit, (uintptr_t) jit -> runtime.memory);
+    emit_byte(jit, 0x48);                               /* mov rax, imm64 */
+    emit_byte(jit, 0xB8 + RAX);
+    emit_u64(jit, function);
+    emit_byte(jit, 0xFF);                               /* call rax */
+    emit_byte(jit, 0xD0);
+    for (unsigned i = 0; i < 4; i++) {
+        emit_rbx(jit, 0x8B, UM_REG(i), 4 * i);
+    }
+}
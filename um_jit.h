@@ -0,0 +1,65 @@
+/**********************************************************************
+ *
+ *              um_jit.h
+ *
+ *          Interface for the x86-64 baseline JIT. Straight-line runs of
+ *          segment 0 are translated into host code with the eight UM
+ *          registers pinned to r8d-r15d. Memory instructions call back
+ *          into the UM_Mem runtime through a Jit_runtime, anything else
+ *          is left to the interpreter in execute_jit().
+ *
+ *          Written by: Ballard Blair and Siddharth Kapoor
+ *
+ ********************************************************************/
+
+#ifndef UM_JIT_INCLUDED
+#define UM_JIT_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct Jit *Jit;
+
+/* a translated block: runs with the given registers and returns the pc of
+   the next instruction to execute */
+typedef uint32_t Jit_block(uint32_t *registers);
+
+/* runtime entry points called by translated code, memory is handed back as
+   the first argument of every call. SLOAD and SSTORE outside segment 0 are
+   done inline: *segments is the segment table, 16-byte entries starting 
+   with the pointer to the segment's words. A segment is only written 
+   inline while the int refs_offset bytes from its words is 1 */
+typedef struct Jit_runtime {
+    void *memory;
+    void **segments;
+    int8_t refs_offset;
+    /* returns nonzero if the store dropped translated code */
+    uint32_t (*sstore)(void *memory, uint32_t seg_id, uint32_t offset,
+                       uint32_t value);
+    uint32_t (*map)(void *memory, uint32_t num_words);
+    void (*unmap)(void *memory, uint32_t seg_id);
+    bool huge_pages;       /* madvise() the code buffer for huge pages */
+} Jit_runtime;
+
+/* returns a new JIT, or NULL if no executable memory can be had */
+extern Jit Jit_new(Jit_runtime runtime);
+
+/* frees the JIT and its code buffer */
+extern void Jit_free(Jit *jit);
+
+/* drops every translation, code is the new segment 0 of length words */
+extern void Jit_reset(Jit jit, const uint32_t *code, uint32_t length);
+
+/* returns the block starting at pc, translating it on a miss, or NULL if
+   the instruction at pc has to be interpreted */
+extern Jit_block *Jit_lookup(Jit jit, uint32_t pc);
+
+/* drops every block covering segment 0 word offset, returns true if there
+   was one */
+extern bool Jit_invalidate(Jit jit, uint32_t offset);
+
+/* returns true if address is in translated code, which keeps UM register 
+   i in host register r(8 + i) */
+extern bool Jit_owns(Jit jit, const void *address);
+
+#endif
@@ -0,0 +1,199 @@
+/**********************************************************************
+ *
+ *              um_perf.c
+ *
+ *          Hardware counters for --perf-counters. Each event is its own
+ *          perf_event_open() counter rather than one group, so a machine
+ *          without, say, an LLC event still reports the others. User
+ *          space only (exclude_kernel), which perf_event_paranoid 2
+ *          allows. When the kernel has more events than counters it
+ *          multiplexes them; counts are then scaled up by the share of
+ *          the time they ran, and the report says so.
+ *
+ *          Written by: Ballard Blair and Siddharth Kapoor
+ *
+ ********************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "um_perf.h"
+
+/* hardware cache event config: cache, operation and result */
+#define CACHE_EVENT(cache, op, result)                                  \
+        ((cache) | ((op) << 8) | ((result) << 16))
+
+typedef struct Event {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} Event;
+
+static const Event events[] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "L1d-load-misses", PERF_TYPE_HW_CACHE,
+      CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                  PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { "LLC-load-misses", PERF_TYPE_HW_CACHE,
+      CACHE_EVENT(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ,
+                  PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { "dTLB-load-misses", PERF_TYPE_HW_CACHE,
+      CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                  PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { "task-clock-ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK }
+};
+
+#define NUM_EVENTS (sizeof(events) / sizeof(events[0]))
+#define CYCLES 0
+#define INSTRUCTIONS 1
+
+struct Perf {
+    int fds[NUM_EVENTS];        /* -1 for an event that could not be had */
+};
+
+/* returns a stopped counter of the event for this thread, or -1 */
+static int open_event(const Event *event);
+
+/* sets *count to the event's count, scaled up if it was multiplexed, and
+   *share to the part of the time it was counting; false if unreadable */
+static bool read_event(int fd, uint64_t *count, double *share);
+
+
+/* opens every counter it can, stopped, and says on stderr which it cannot */
+extern Perf Perf_new(void)
+{
+    Perf perf = malloc(sizeof(*perf));
+    int missing = 0;
+    int error = 0;
+
+    assert(perf != NULL);
+    for (size_t i = 0; i < NUM_EVENTS; i++) {
+        perf -> fds[i] = open_event(&events[i]);
+        if (perf -> fds[i] < 0) {
+            if (missing++ == 0) {
+                error = errno;
+                fprintf(stderr, "um: no perf counter for");
+            }
+            fprintf(stderr, " %s", events[i].name);
+        }
+    }
+    if (missing > 0) {
+        fprintf(stderr, " (%s)\n", strerror(error));
+    }
+    return perf;
+}
+
+/* starts the counters, which add to what they have counted so far */
+extern void Perf_start(Perf perf)
+{
+    for (size_t i = 0; i < NUM_EVENTS; i++) {
+        if (perf -> fds[i] >= 0) {
+            ioctl(perf -> fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+/* stops the counters */
+extern void Perf_stop(Perf perf)
+{
+    for (size_t i = 0; i < NUM_EVENTS; i++) {
+        if (perf -> fds[i] >= 0) {
+            ioctl(perf -> fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+}
+
+/* prints each count to fp, per UM instruction when instructions is not 0,
+   with instructions per cycle under the host instruction count */
+extern void Perf_report(Perf perf, uint64_t instructions, FILE *fp)
+{
+    uint64_t counts[NUM_EVENTS];
+    bool counted[NUM_EVENTS];
+
+    fprintf(fp, "perf counters, execution only");
+    if (instructions > 0) {
+        fprintf(fp, ", %" PRIu64 " UM instructions", instructions);
+    }
+    fprintf(fp, ":\n");
+    for (size_t i = 0; i < NUM_EVENTS; i++) {
+        double share = 1.0;
+
+        counted[i] = perf -> fds[i] >= 0
+                     && read_event(perf -> fds[i], &counts[i], &share);
+        if (!counted[i]) {
+            fprintf(fp, "%20s  %15s\n", events[i].name, "n/a");
+            continue;
+        }
+        fprintf(fp, "%20s  %15" PRIu64, events[i].name, counts[i]);
+        if (instructions > 0) {
+            fprintf(fp, "  %10.4f per UM instruction",
+                    (double) counts[i] / instructions);
+        }
+        if (i == INSTRUCTIONS && counted[CYCLES] && counts[CYCLES] > 0) {
+            fprintf(fp, "  %.2f IPC",
+                    (double) counts[i] / counts[CYCLES]);
+        }
+        if (share < 1.0) {
+            fprintf(fp, "  (scaled, counted %.0f%%)", 100 * share);
+        }
+        fprintf(fp, "\n");
+    }
+}
+
+/* closes the counters and sets *perf to NULL */
+extern void Perf_free(Perf *perf)
+{
+    for (size_t i = 0; i < NUM_EVENTS; i++) {
+        if ((*perf) -> fds[i] >= 0) {
+            close((*perf) -> fds[i]);
+        }
+    }
+    free(*perf);
+    *perf = NULL;
+}
+
+/* returns a stopped counter of the event for this thread, or -1 */
+static int open_event(const Event *event)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = event -> type;
+    attr.config = event -> config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+                       | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* sets *count to the event's count, scaled up if it was multiplexed, and
+   *share to the part of the time it was counting; false if unreadable */
+static bool read_event(int fd, uint64_t *count, double *share)
+{
+    uint64_t values[3];     /* count, time enabled, time running */
+
+    if (read(fd, values, sizeof(values)) != sizeof(values)) {
+        return false;
+    }
+    *count = values[0];
+    *share = 1.0;
+    if (values[2] > 0 && values[2] < values[1]) {
+        *share = (double) values[2] / values[1];
+        *count = (uint64_t) (values[0] / *share);
+    }
+    return true;
+}
@@ -0,0 +1,39 @@
+/**********************************************************************
+ *
+ *              um_perf.h
+ *
+ *          Interface for the hardware counters behind --perf-counters.
+ *          Linux perf_event_open() counters for this thread are opened
+ *          stopped and only run between Perf_start() and Perf_stop(), so
+ *          loading the image and tearing the machine down are left out.
+ *          Counters the kernel or the CPU does not offer (in a container
+ *          or a VM, often all of the hardware ones) are skipped.
+ *
+ *          Written by: Ballard Blair and Siddharth Kapoor
+ *
+ ********************************************************************/
+
+#ifndef UM_PERF_INCLUDED
+#define UM_PERF_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct Perf *Perf;
+
+/* opens every counter it can, stopped, and says on stderr which it cannot */
+extern Perf Perf_new(void);
+
+/* starts the counters, which add to what they have counted so far */
+extern void Perf_start(Perf perf);
+
+/* stops the counters */
+extern void Perf_stop(Perf perf);
+
+/* prints each count to fp, per UM instruction when instructions is not 0 */
+extern void Perf_report(Perf perf, uint64_t instructions, FILE *fp);
+
+/* closes the counters and sets *perf to NULL */
+extern void Perf_free(Perf *perf);
+
+#endif
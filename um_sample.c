@@ -0,0 +1,171 @@
+/**********************************************************************
+ *
+ *              um_sample.c
+ *
+ *          Samples for --sample, counted by stack in an open addressing
+ *          hash table. A stack is kept as a run of words: loads, depth,
+ *          the call targets and the pc. Samples arrive a few hundred a
+ *          second, so nothing here is in a hurry; the table only has to
+ *          stay small while a long run piles up the same stacks.
+ *
+ *          Written by: Ballard Blair and Siddharth Kapoor
+ *
+ ********************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include "um_sample.h"
+
+#define initial_slots 1024     /* a power of two */
+
+typedef struct Stack {
+    uint32_t *words;           /* loads, depth, calls, pc; NULL if free */
+    uint32_t length;
+    uint64_t hash;
+    uint64_t count;
+} Stack;
+
+struct Samples {
+    Stack *slots;
+    uint32_t num_slots;
+    uint32_t used;
+};
+
+/* returns the FNV-1a hash of length words */
+static uint64_t hash_words(const uint32_t *words, uint32_t length);
+
+/* returns the slot of the stack of words, or the free slot it belongs in */
+static Stack *find_slot(Samples samples, const uint32_t *words,
+                        uint32_t length, uint64_t hash);
+
+/* doubles the table */
+static void grow(Samples samples);
+
+
+/* returns an empty set of samples */
+extern Samples Samples_new(void)
+{
+    Samples samples = malloc(sizeof(*samples));
+
+    assert(samples != NULL);
+    samples -> slots = calloc(initial_slots, sizeof(Stack));
+    assert(samples -> slots != NULL);
+    samples -> num_slots = initial_slots;
+    samples -> used = 0;
+    return samples;
+}
+
+/* adds count samples taken at pc with depth calls on the stack */
+extern void Samples_add(Samples samples, uint32_t loads,
+                        const uint32_t *calls, int depth, uint32_t pc,
+                        uint64_t count)
+{
+    uint32_t length = depth + 3;
+    uint32_t words[length];
+
+    words[0] = loads;
+    words[1] = depth;
+    memcpy(words + 2, calls, depth * sizeof(uint32_t));
+    words[length - 1] = pc;
+
+    uint64_t hash = hash_words(words, length);
+    Stack *stack = find_slot(samples, words, length, hash);
+    if (stack -> words == NULL) {
+        stack -> words = malloc(length * sizeof(uint32_t));
+        assert(stack -> words != NULL);
+        memcpy(stack -> words, words, length * sizeof(uint32_t));
+        stack -> length = length;
+        stack -> hash = hash;
+        if (++(samples -> used) * 2 > samples -> num_slots) {
+            grow(samples);
+            stack = find_slot(samples, words, length, hash);
+        }
+    }
+    stack -> count += count;
+}
+
+/* writes the samples to fp as folded stacks. The outermost frame is the
+   code the sample ran in, "image" for the program loaded and "load N"
+   for what the Nth LOADP of another segment put in segment 0; then come
+   the calls and last the pc */
+extern void Samples_write(Samples samples, FILE *fp)
+{
+    for (uint32_t i = 0; i < samples -> num_slots; i++) {
+        Stack *stack = &(samples -> slots[i]);
+
+        if (stack -> words == NULL) {
+            continue;
+        }
+        if (stack -> words[0] == 0) {
+            fprintf(fp, "image");
+        } else {
+            fprintf(fp, "load %" PRIu32, stack -> words[0]);
+        }
+        for (uint32_t j = 2; j < stack -> length; j++) {
+            fprintf(fp, ";pc %" PRIu32, stack -> words[j]);
+        }
+        fprintf(fp, " %" PRIu64 "\n", stack -> count);
+    }
+}
+
+/* frees the samples and sets *samples to NULL */
+extern void Samples_free(Samples *samples)
+{
+    for (uint32_t i = 0; i < (*samples) -> num_slots; i++) {
+        free((*samples) -> slots[i].words);
+    }
+    free((*samples) -> slots);
+    free(*samples);
+    *samples = NULL;
+}
+
+/* returns the FNV-1a hash of length words */
+static uint64_t hash_words(const uint32_t *words, uint32_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (uint32_t i = 0; i < length; i++) {
+        hash = (hash ^ words[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* returns the slot of the stack of words, or the free slot it belongs in;
+   the table is never more than half full, so there always is one */
+static Stack *find_slot(Samples samples, const uint32_t *words,
+                        uint32_t length, uint64_t hash)
+{
+    uint32_t mask = samples -> num_slots - 1;
+
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        Stack *stack = &(samples -> slots[i]);
+        if (stack -> words == NULL
+            || (stack -> hash == hash && stack -> length == length
+                && memcmp(stack -> words, words,
+                          length * sizeof(uint32_t)) == 0)) {
+            return stack;
+        }
+    }
+}
+
+/* doubles the table */
+static void grow(Samples samples)
+{
+    Stack *old = samples -> slots;
+    uint32_t old_slots = samples -> num_slots;
+
+    samples -> num_slots *= 2;
+    samples -> slots = calloc(samples -> num_slots, sizeof(Stack));
+    assert(samples -> slots != NULL);
+    for (uint32_t i = 0; i < old_slots; i++) {
+        if (old[i].words != NULL) {
+            *find_slot(samples, old[i].words, old[i].length,
+                       old[i].hash) = old[i];
+        }
+    }
+    free(old);
+}
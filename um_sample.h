@@ -0,0 +1,40 @@
+/**********************************************************************
+ *
+ *              um_sample.h
+ *
+ *          Interface for the samples behind --sample. Each sample is a
+ *          UM call stack: the code it ran in, the pcs the calls on the
+ *          stack jumped to, outermost first, and the pc it was taken at.
+ *          Equal stacks are counted together and written as folded
+ *          stacks, one "frame;frame;frame count" line each, which
+ *          flamegraph.pl and other flame graph tools read as they are.
+ *
+ *          Written by: Ballard Blair and Siddharth Kapoor
+ *
+ ********************************************************************/
+
+#ifndef UM_SAMPLE_INCLUDED
+#define UM_SAMPLE_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct Samples *Samples;
+
+/* returns an empty set of samples */
+extern Samples Samples_new(void);
+
+/* adds count samples taken at pc with depth calls on the stack, made to
+   the pcs in calls. loads is the number of LOADPs of another segment
+   before it, which tells apart the programs segment 0 has held */
+extern void Samples_add(Samples samples, uint32_t loads,
+                        const uint32_t *calls, int depth, uint32_t pc,
+                        uint64_t count);
+
+/* writes the samples to fp as folded stacks */
+extern void Samples_write(Samples samples, FILE *fp);
+
+/* frees the samples and sets *samples to NULL */
+extern void Samples_free(Samples *samples);
+
+#endif
@@ -0,0 +1,543 @@
+/**********************************************************************
+ *
+ *              um_sched.c
+ *
+ *          Runs many UM machines at once on a few worker threads (M:N).
+ *          Every machine is a libum UM_Mem run a quantum of instructions
+ *          at a time. Each worker has its own run queue, takes from its
+ *          head and puts preempted machines back on its tail, and steals
+ *          from the others when its own is empty. A machine stopped on
+ *          INPUT with nothing to read is parked with a poller thread,
+ *          which queues it again once its input fd has bytes (or ends).
+ *
+ *          usage: um_sched [-t threads] [-q quantum] [-n copies]
+ *                          [-o prefix | -d] IMAGE[,INPUT]...
+ *
+ *          Job i (the command line jobs, -n times over) writes its output
+ *          to PREFIX<i>.out, "job" by default, or nowhere with -d.
+ *
+ *          Written by: Ballard Blair and Siddharth Kapoor
+ *
+ ********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "um.h"
+
+#define read_chunk 65536
+
+/* one machine and where its bytes come from and go */
+typedef struct Job {
+    UM_Mem machine;
+    int input_fd;          /* -1 when the job has no input */
+    int output_fd;         /* -1 to discard output */
+    struct Job *next;      /* in a run queue or on the parked list */
+} Job;
+
+/* a worker's jobs, in the order they get their next quantum */
+typedef struct Run_queue {
+    pthread_mutex_t lock;
+    Job *head;
+    Job *tail;
+} Run_queue;
+
+typedef struct Scheduler {
+    Run_queue *queues;     /* one per worker */
+    int num_workers;
+    uint64_t quantum;
+
+    /* read and written with __atomic builtins only, so queueing a job
+       takes no lock beyond its run queue's */
+    int runnable;          /* jobs sitting in run queues, or on the way */
+    int sleeping;          /* workers waiting on wake */
+
+    pthread_mutex_t lock;  /* guards everything below */
+    pthread_cond_t wake;   /* a job was queued or the last one finished */
+    int remaining;         /* jobs not finished yet */
+    Job *parked;           /* jobs waiting on their input fd */
+    int next_queue;        /* where the poller puts woken jobs */
+    int halted;
+    int failed;
+    uint64_t instructions;
+
+    int wake_pipe[2];      /* tells the poller the parked list changed */
+} Scheduler;
+
+/* what one worker thread gets */
+typedef struct Worker {
+    Scheduler *scheduler;
+    int id;
+} Worker;
+
+/* returns a job running image on input (NULL for none), writing to
+   output (NULL to discard) */
+static Job *new_job(const unsigned char *image, size_t size,
+                    const char *input, const char *output);
+
+/* appends the job to queue id and wakes a sleeping worker */
+static void push_job(Scheduler *s, int id, Job *job);
+
+/* takes the job at the head of queue id, or steals one from another 
+   queue, returns NULL if every queue is empty */
+static Job *pop_job(Scheduler *s, int id);
+
+/* runs jobs until every one has finished */
+static void *worker_main(void *arg);
+
+/* runs one quantum of the job and sends it where it belongs next */
+static void run_quantum(Scheduler *s, int id, Job *job);
+
+/* feeds the job what its input fd has, returns false if it would block */
+static bool feed_input(Job *job);
+
+/* hands the job to the poller until its input fd is readable */
+static void park_job(Scheduler *s, Job *job);
+
+/* frees the finished job and counts it */
+static void finish_job(Scheduler *s, Job *job, Um_status status);
+
+/* waits on the input fds of parked jobs and queues them when readable */
+static void *poller_main(void *arg);
+
+/* returns the contents of filename and sets *size, exits if unreadable */
+static unsigned char *read_file(const char *filename, size_t *size);
+
+
+int main(int argc, char *argv[])
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_workers = cpus > 0 ? cpus : 1;
+    uint64_t quantum = 1000000;
+    int copies = 1;
+    const char *prefix = "job";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:q:n:o:d")) != -1) {
+        if (opt == 't') {
+            num_workers = atoi(optarg);
+        } else if (opt == 'q') {
+            quantum = strtoull(optarg, NULL, 0);
+        } else if (opt == 'n') {
+            copies = atoi(optarg);
+        } else if (opt == 'o') {
+            prefix = optarg;
+        } else if (opt == 'd') {
+            prefix = NULL;
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind >= argc || num_workers < 1 || quantum == 0 || copies < 1) {
+        fprintf(stderr, "usage: %s [-t threads] [-q quantum] [-n copies] "
+                        "[-o prefix | -d] IMAGE[,INPUT]...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Scheduler s;
+    memset(&s, 0, sizeof(s));
+    s.num_workers = num_workers;
+    s.quantum = quantum;
+    s.queues = calloc(num_workers, sizeof(*s.queues));
+    assert(s.queues != NULL);
+    for (int i = 0; i < num_workers; i++) {
+        pthread_mutex_init(&s.queues[i].lock, NULL);
+    }
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.wake, NULL);
+    int failed = pipe(s.wake_pipe);
+    assert(!failed);
+    fcntl(s.wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(s.wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+    /* every job is made before any runs, spread over the queues */
+    int num_jobs = 0;
+    for (int copy = 0; copy < copies; copy++) {
+        for (int i = optind; i < argc; i++) {
+            char *spec = strdup(argv[i]);
+            char *input = strchr(spec, ',');
+            if (input != NULL) {
+                *input++ = '\0';
+            }
+            size_t size;
+            unsigned char *image = read_file(spec, &size);
+
+            char output[4096];
+            if (prefix != NULL) {
+                snprintf(output, sizeof(output), "%s%d.out", prefix,
+                         num_jobs);
+            }
+            Job *job = new_job(image, size, input,
+                               prefix != NULL ? output : NULL);
+            push_job(&s, num_jobs % num_workers, job);
+            num_jobs++;
+            s.remaining++;
+            free(image);
+            free(spec);
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t poller;
+    pthread_t *threads = malloc(num_workers * sizeof(*threads));
+    Worker *workers = malloc(num_workers * sizeof(*workers));
+    assert(threads != NULL && workers != NULL);
+    failed = pthread_create(&poller, NULL, poller_main, &s);
+    assert(!failed);
+    for (int i = 0; i < num_workers; i++) {
+        workers[i].scheduler = &s;
+        workers[i].id = i;
+        failed = pthread_create(&threads[i], NULL, worker_main, 
+                                &workers[i]);
+        assert(!failed);
+    }
+    (void) failed;
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_join(poller, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec)
+                     + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%d jobs on %d threads: %d halted, %d failed, "
+                    "%" PRIu64 " instructions in %.3f s, %.1f MIPS\n",
+            num_jobs, num_workers, s.halted, s.failed, s.instructions,
+            seconds, s.instructions / seconds / 1e6);
+
+    free(threads);
+    free(workers);
+    free(s.queues);
+    close(s.wake_pipe[0]);
+    close(s.wake_pipe[1]);
+    return s.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* returns a job running image on input (NULL for none), writing to
+   output (NULL to discard). Input fds that can block are made
+   nonblocking so a worker never waits on one */
+static Job *new_job(const unsigned char *image, size_t size,
+                    const char *input, const char *output)
+{
+    Job *job = malloc(sizeof(*job));
+    assert(job != NULL);
+
+    job -> machine = Um_new(image, size);
+    job -> input_fd = -1;
+    job -> output_fd = -1;
+    job -> next = NULL;
+    if (input != NULL) {
+        /* a FIFO opened nonblocking would read as ended until its writer
+           shows up, so wait for the writer first */
+        job -> input_fd = open(input, O_RDONLY);
+        if (job -> input_fd < 0) {
+            perror(input);
+            exit(EXIT_FAILURE);
+        }
+        fcntl(job -> input_fd, F_SETFL, O_NONBLOCK);
+    } else {
+        Um_end_input(job -> machine);
+    }
+    if (output != NULL) {
+        job -> output_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (job -> output_fd < 0) {
+            perror(output);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return job;
+}
+
+/* appends the job to queue id and wakes a sleeping worker, if there is 
+   one. runnable goes up before the job is visible, so a thief that takes
+   it never sees the count go below zero. Against worker_main() this is 
+   the store-then-load pattern either way round: with both sequentially 
+   consistent, either the worker sees the job and stays up or we see the 
+   worker and signal it, under the lock it waits with */
+static void push_job(Scheduler *s, int id, Job *job)
+{
+    Run_queue *queue = &s -> queues[id];
+
+    job -> next = NULL;
+    __atomic_add_fetch(&s -> runnable, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&queue -> lock);
+    if (queue -> tail == NULL) {
+        queue -> head = job;
+    } else {
+        queue -> tail -> next = job;
+    }
+    queue -> tail = job;
+    pthread_mutex_unlock(&queue -> lock);
+
+    if (__atomic_load_n(&s -> sleeping, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&s -> lock);
+        pthread_cond_signal(&s -> wake);
+        pthread_mutex_unlock(&s -> lock);
+    }
+}
+
+/* removes and returns the head of queue, NULL if it is empty */
+static Job *take_from(Run_queue *queue)
+{
+    pthread_mutex_lock(&queue -> lock);
+    Job *job = queue -> head;
+    if (job != NULL) {
+        queue -> head = job -> next;
+        if (queue -> head == NULL) {
+            queue -> tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&queue -> lock);
+    return job;
+}
+
+/* takes the job at the head of queue id, or steals one from another 
+   queue, trying the next one over first, returns NULL if every queue is 
+   empty */
+static Job *pop_job(Scheduler *s, int id)
+{
+    Job *job = take_from(&s -> queues[id]);
+
+    for (int i = 1; job == NULL && i < s -> num_workers; i++) {
+        job = take_from(&s -> queues[(id + i) % s -> num_workers]);
+    }
+    if (job != NULL) {
+        __atomic_sub_fetch(&s -> runnable, 1, __ATOMIC_SEQ_CST);
+    }
+    return job;
+}
+
+/* runs jobs until every one has finished, sleeping while none is
+   runnable. Only going to sleep and waking up take the global lock */
+static void *worker_main(void *arg)
+{
+    Worker *worker = arg;
+    Scheduler *s = worker -> scheduler;
+
+    for (;;) {
+        Job *job = pop_job(s, worker -> id);
+        if (job != NULL) {
+            run_quantum(s, worker -> id, job);
+            continue;
+        }
+        pthread_mutex_lock(&s -> lock);
+        __atomic_add_fetch(&s -> sleeping, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&s -> runnable, __ATOMIC_SEQ_CST) == 0 
+               && s -> remaining > 0) {
+            pthread_cond_wait(&s -> wake, &s -> lock);
+        }
+        __atomic_sub_fetch(&s -> sleeping, 1, __ATOMIC_SEQ_CST);
+        bool done = s -> remaining == 0;
+        pthread_mutex_unlock(&s -> lock);
+        if (done) {
+            return NULL;
+        }
+    }
+}
+
+/* copies everything the machine has written to the job's output */
+static void drain_output(Job *job)
+{
+    unsigned char buffer[read_chunk];
+    size_t n;
+
+    while ((n = Um_take_output(job -> machine, buffer,
+                               sizeof(buffer))) > 0) {
+        for (size_t done = 0; job -> output_fd >= 0 && done < n; ) {
+            ssize_t written = write(job -> output_fd, buffer + done,
+                                    n - done);
+            assert(written > 0);
+            done += written;
+        }
+    }
+}
+
+/* runs one quantum of the job and sends it where it belongs next:
+   the back of this worker's queue, the poller, or done */
+static void run_quantum(Scheduler *s, int id, Job *job)
+{
+    Um_status status = Um_run(job -> machine, s -> quantum);
+
+    drain_output(job);
+    if (status == UM_BUDGET_EXHAUSTED) {
+        push_job(s, id, job);
+    } else if (status == UM_NEEDS_INPUT) {
+        if (feed_input(job)) {
+            push_job(s, id, job);
+        } else {
+            park_job(s, job);
+        }
+    } else {
+        finish_job(s, job, status);
+    }
+}
+
+/* feeds the job what its input fd has, returns false if it would block.
+   End of file (or an error) ends the machine's input */
+static bool feed_input(Job *job)
+{
+    unsigned char buffer[read_chunk];
+    ssize_t n = read(job -> input_fd, buffer, sizeof(buffer));
+
+    if (n > 0) {
+        Um_put_input(job -> machine, buffer, n);
+        return true;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return false;
+    }
+    Um_end_input(job -> machine);
+    return true;
+}
+
+/* makes the poller look at the parked list again */
+static void wake_poller(Scheduler *s)
+{
+    /* a full pipe already has a wakeup in it */
+    ssize_t written = write(s -> wake_pipe[1], "w", 1);
+    (void) written;
+}
+
+/* hands the job to the poller until its input fd is readable */
+static void park_job(Scheduler *s, Job *job)
+{
+    pthread_mutex_lock(&s -> lock);
+    job -> next = s -> parked;
+    s -> parked = job;
+    pthread_mutex_unlock(&s -> lock);
+    wake_poller(s);
+}
+
+/* frees the finished job and counts it, the last one wakes everybody */
+static void finish_job(Scheduler *s, Job *job, Um_status status)
+{
+    uint64_t instructions = Um_instructions(job -> machine);
+
+    if (job -> input_fd >= 0) {
+        close(job -> input_fd);
+    }
+    if (job -> output_fd >= 0) {
+        close(job -> output_fd);
+    }
+    Um_free(&(job -> machine));
+    free(job);
+
+    pthread_mutex_lock(&s -> lock);
+    s -> instructions += instructions;
+    if (status == UM_HALTED) {
+        s -> halted++;
+    } else {
+        s -> failed++;
+    }
+    bool last = --(s -> remaining) == 0;
+    if (last) {
+        pthread_cond_broadcast(&s -> wake);
+    }
+    pthread_mutex_unlock(&s -> lock);
+    if (last) {
+        wake_poller(s);
+    }
+}
+
+/* waits on the input fds of parked jobs and queues them when readable,
+   until every job has finished */
+static void *poller_main(void *arg)
+{
+    Scheduler *s = arg;
+    struct pollfd *fds = NULL;
+    Job **jobs = NULL;
+    size_t capacity = 0;
+
+    for (;;) {
+        /* the wake pipe first, then one entry per parked job */
+        pthread_mutex_lock(&s -> lock);
+        bool done = s -> remaining == 0;
+        size_t n = 1;
+        for (Job *job = s -> parked; job != NULL; job = job -> next) {
+            n++;
+        }
+        if (n > capacity) {
+            capacity = 2 * n;
+            fds = realloc(fds, capacity * sizeof(*fds));
+            jobs = realloc(jobs, capacity * sizeof(*jobs));
+            assert(fds != NULL && jobs != NULL);
+        }
+        fds[0].fd = s -> wake_pipe[0];
+        fds[0].events = POLLIN;
+        n = 1;
+        for (Job *job = s -> parked; job != NULL; job = job -> next) {
+            fds[n].fd = job -> input_fd;
+            fds[n].events = POLLIN;
+            jobs[n] = job;
+            n++;
+        }
+        pthread_mutex_unlock(&s -> lock);
+        if (done) {
+            break;
+        }
+
+        if (poll(fds, n, -1) < 0) {
+            assert(errno == EINTR);
+            continue;
+        }
+        if (fds[0].revents != 0) {
+            char drain[64];
+            while (read(s -> wake_pipe[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+        for (size_t i = 1; i < n; i++) {
+            if (fds[i].revents == 0 || !feed_input(jobs[i])) {
+                continue;
+            }
+            pthread_mutex_lock(&s -> lock);
+            Job **link = &s -> parked;
+            while (*link != jobs[i]) {
+                link = &(*link) -> next;
+            }
+            *link = jobs[i] -> next;
+            int id = s -> next_queue;
+            s -> next_queue = (id + 1) % s -> num_workers;
+            pthread_mutex_unlock(&s -> lock);
+            push_job(s, id, jobs[i]);
+        }
+    }
+    free(fds);
+    free(jobs);
+    return NULL;
+}
+
+/* returns the contents of filename and sets *size, exits if unreadable */
+static unsigned char *read_file(const char *filename, size_t *size)
+{
+    FILE *fp = fopen(filename, "rb");
+    struct stat st;
+
+    if (fp == NULL || fstat(fileno(fp), &st) != 0) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    *size = st.st_size;
+    unsigned char *bytes = malloc(*size + 1);
+    assert(bytes != NULL);
+    if (fread(bytes, 1, *size, fp) != *size) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+    return bytes;
+}